@@ -1,4 +1,3 @@
-
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -12,6 +11,7 @@
 #include "json.hpp"
 
 #include <vector>
+#include <array>
 #include <string>
 #include <unordered_map>
 #include <fstream>
@@ -19,18 +19,95 @@
 #include <iomanip>
 #include <regex>
 #include <limits>
+#include <cmath>
+#include <numeric>
 #include <chrono>
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <random>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define SPRITEBAKER_SSE2
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define SPRITEBAKER_TARGET_AVX2
+    #else
+        #define SPRITEBAKER_TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
 
 constexpr const char* version = "3.0.0";
 
+enum class ScaleFilter
+{
+    Default,
+    Nearest,
+    Box
+};
+
+// The order the rects are packed in, all largest first. Default is stb_rect_pack's own sort by height.
+enum class PackOrder
+{
+    Default,
+    Height,
+    Width,
+    Area,
+    MaxSide,
+    Perimeter
+};
+
+constexpr const char* pack_order_names[] = { "default", "height", "width", "area", "max_side", "perimeter" };
+constexpr const char* skyline_heuristic_names[] = { "bl", "bf" };
+
+enum class Packer
+{
+    Skyline,
+    MaxRects
+};
+
+constexpr const char* packer_names[] = { "skyline", "maxrects" };
+
+enum class MaxRectsHeuristic
+{
+    BestShortSideFit,
+    BestAreaFit,
+    BottomLeft,
+    ContactPoint
+};
+
+constexpr const char* maxrects_heuristic_names[] = { "bssf", "baf", "bl", "cp" };
+
+const std::vector<std::string>& PackHeuristicNames(Packer packer)
+{
+    static const std::vector<std::string> skyline_names(std::begin(skyline_heuristic_names), std::end(skyline_heuristic_names));
+    static const std::vector<std::string> maxrects_names(std::begin(maxrects_heuristic_names), std::end(maxrects_heuristic_names));
+    return (packer == Packer::MaxRects) ? maxrects_names : skyline_names;
+}
+
 struct Context
 {
     // Required
     std::vector<std::string> input_files;
     std::string output_file;
-    int output_width;
-    int output_height;
+    int output_width = 0;
+    int output_height = 0;
 
     // Optional arguments
     int scale_in_percentage = 100;
@@ -41,17 +118,134 @@ struct Context
     unsigned char background_a = 0;
     bool trim_images = false;
     bool write_sprite_format = false;
+    bool layout_only = false;
+    bool deduplicate = false;
+    bool deduplicate_flips = false;
+    int polygon_mesh_vertices = 0;
+    bool opaque_rects = false;
+    int hit_mask_threshold = 0;
     std::string sprite_folder;
+    std::string cache_dir;
+    std::string artifact_cache;
+    std::string previous_layout;
+    int layout_slack = 0;
+    std::vector<int> scales;
+    bool proportional_layout = false;
+    int mip_levels = 0;
+    int mip_coverage_reference = 0;
+    bool premultiply_alpha = false;
+    bool srgb = false;
+    ScaleFilter scale_filter = ScaleFilter::Default;
+    Packer packer = Packer::Skyline;
+    int pack_heuristic = 0;
+    PackOrder pack_order = PackOrder::Default;
+    bool pack_search = false;
+    bool auto_size = false;
+    bool auto_size_pow2 = false;
+    bool auto_size_square = false;
+    int max_size = 8192;
+    int size_multiple = 1;
+    bool multi_page = false;
+    int jobs = std::max(1, int(std::thread::hardware_concurrency()));
 };
 
+// Pixel memory owned together with its deleter, so the buffer returned by stbi_load can be adopted as is.
+using PixelBuffer = std::shared_ptr<unsigned char>;
+
+PixelBuffer AdoptPixels(unsigned char* data)
+{
+    return PixelBuffer(data, stbi_image_free);
+}
+
+PixelBuffer AllocatePixels(size_t size)
+{
+    // Same allocator as stb_image, the memory is left uninitialized since it's always overwritten. Empty images
+    // still get a byte, malloc(0) may return null which would read as running out of memory.
+    unsigned char* data = static_cast<unsigned char*>(STBI_MALLOC(std::max<size_t>(size, 1)));
+    if(!data)
+        throw std::runtime_error("Unable to allocate image memory");
+
+    return AdoptPixels(data);
+}
+
+// An image can be a view into a bigger buffer, data points at its first pixel and shares the ownership of the
+// whole buffer, and stride is the number of bytes between the start of two rows.
 struct ImageData
 {
     int width;
     int height;
     int color_components;
-    std::vector<unsigned char> data;
+    int stride;
+    PixelBuffer data;
+
+    // The size before trimming and where the trimmed image is placed within it.
+    int source_width;
+    int source_height;
+    int offset_x;
+    int offset_y;
+};
+
+const unsigned char* ImageRow(const ImageData& image, int row)
+{
+    return image.data.get() + size_t(row) * image.stride;
+}
+
+struct ImageSize
+{
+    int width;
+    int height;
+};
+
+struct AlphaBounds
+{
+    int left;
+    int top;
+    int right;
+    int bottom;
+};
+
+struct MeshVertex
+{
+    float x;
+    float y;
+};
+
+struct FrameInfo
+{
+    // The image shown by this frame, duplicates of an earlier image point to that image and share its rect.
+    size_t image_index;
+
+    // Set if the frame is the image mirrored horizontally and/or vertically, both is a 180° rotation.
+    bool flip_x = false;
+    bool flip_y = false;
+
+    // The untrimmed size of the frame's own input and the position of the trimmed frame within it.
+    int source_width = 0;
+    int source_height = 0;
+    int offset_x = 0;
+    int offset_y = 0;
+
+    // Convex outline of the frame's non transparent pixels in frame pixels, and its triangles.
+    std::vector<MeshVertex> mesh_vertices;
+    std::vector<int> mesh_indices;
+
+    // Largest fully opaque rect of the frame in frame pixels, empty if it has no opaque pixels.
+    AlphaBounds opaque_rect = {};
+
+    // The output image the frame is packed into with 'multi_page'.
+    int page = 0;
 };
 
+// The smallest layout unit 'proportional_layout' accepts, in percent. Frames take whole units, so a smaller unit
+// rounds them up to ever larger steps at the big scales, at 1% every frame takes 100 pixel steps at 100%.
+constexpr int min_layout_unit_percentage = 10;
+
+// The layout unit of 'proportional_layout', the greatest common divisor of the scales.
+int LayoutUnitPercentage(const std::vector<int>& scales)
+{
+    return std::accumulate(scales.begin(), scales.end(), 0, std::gcd<int, int>);
+}
+
 void ParseArguments(int argv, const char** argc, Context& context)
 {
     std::unordered_map<std::string, std::string> options_table;
@@ -87,17 +281,26 @@ void ParseArguments(int argv, const char** argc, Context& context)
     const bool has_input = input_it != end && !input_it->second.empty();
     const bool has_output = output_it != end && !output_it->second.empty();
 
-    if(!has_width)
+    // An auto sized output image has no fixed size.
+    const auto auto_size_it = options_table.find("auto_size");
+    context.auto_size = (auto_size_it != end);
+
+    if(context.auto_size && (width_it != end || height_it != end))
+        throw std::runtime_error("Invalid arguments, 'width' and 'height' can't be used with 'auto_size', use 'max_size'.");
+    else if(!has_width && !context.auto_size)
         throw std::runtime_error("Invalid arguments, missing valid 'width'.");
-    else if(!has_height)
+    else if(!has_height && !context.auto_size)
         throw std::runtime_error("Invalid arguments, missing valid 'height'.");
     else if(!has_input)
         throw std::runtime_error("Invalid arguments, missing valid 'input'.");
     else if(!has_output)
         throw std::runtime_error("Invalid arguments, missing valid 'output'.");
 
-    context.output_width = std::stoi(width_it->second);
-    context.output_height = std::stoi(height_it->second);
+    if(!context.auto_size)
+    {
+        context.output_width = std::stoi(width_it->second);
+        context.output_height = std::stoi(height_it->second);
+    }
     context.output_file = output_it->second;
 
     {
@@ -143,219 +346,3392 @@ void ParseArguments(int argv, const char** argc, Context& context)
 
     context.trim_images = (options_table.find("trim_images") != end);
     context.write_sprite_format = (options_table.find("sprite_format") != end);
+    context.layout_only = (options_table.find("layout_only") != end);
+    context.deduplicate_flips = (options_table.find("dedup_flips") != end);
+    context.deduplicate = context.deduplicate_flips || (options_table.find("dedup") != end);
+    context.opaque_rects = (options_table.find("opaque_rects") != end);
+    context.premultiply_alpha = (options_table.find("premultiply_alpha") != end);
+    context.srgb = (options_table.find("srgb") != end);
+
+    const auto scale_filter_it = options_table.find("scale_filter");
+    if(scale_filter_it != end)
+    {
+        const std::string& scale_filter = scale_filter_it->second;
+        if(scale_filter == "nearest")
+            context.scale_filter = ScaleFilter::Nearest;
+        else if(scale_filter == "box")
+            context.scale_filter = ScaleFilter::Box;
+        else if(scale_filter != "default")
+            throw std::runtime_error("Invalid arguments, 'scale_filter' must be one of nearest, box or default.");
+    }
     const auto sprite_folder_it = options_table.find("sprite_folder");
     if(sprite_folder_it != options_table.end())
         context.sprite_folder = sprite_folder_it->second;
+
+    const auto polygon_mesh_it = options_table.find("polygon_mesh");
+    if(polygon_mesh_it != end)
+    {
+        context.polygon_mesh_vertices = polygon_mesh_it->second.empty() ? 8 : std::stoi(polygon_mesh_it->second);
+        if(context.polygon_mesh_vertices < 4)
+            throw std::runtime_error("Invalid arguments, 'polygon_mesh' needs at least 4 vertices.");
+    }
+
+    const auto hit_masks_it = options_table.find("hit_masks");
+    if(hit_masks_it != end)
+    {
+        context.hit_mask_threshold = hit_masks_it->second.empty() ? 128 : std::stoi(hit_masks_it->second);
+        if(context.hit_mask_threshold < 1 || context.hit_mask_threshold > 255)
+            throw std::runtime_error("Invalid arguments, 'hit_masks' threshold must be in the range 1 - 255.");
+    }
+
+    const auto cache_dir_it = options_table.find("cache_dir");
+    if(cache_dir_it != end)
+        context.cache_dir = cache_dir_it->second;
+
+    const auto artifact_cache_it = options_table.find("artifact_cache");
+    if(artifact_cache_it != end)
+        context.artifact_cache = artifact_cache_it->second;
+
+    const auto previous_layout_it = options_table.find("previous_layout");
+    if(previous_layout_it != end)
+        context.previous_layout = previous_layout_it->second;
+
+    const auto layout_slack_it = options_table.find("layout_slack");
+    if(layout_slack_it != end)
+        context.layout_slack = std::stoi(layout_slack_it->second);
+
+    if(!context.previous_layout.empty() && context.write_sprite_format)
+        throw std::runtime_error("Invalid arguments, 'previous_layout' needs the generic json output and can't be used with 'sprite_format'.");
+
+    const auto packer_it = options_table.find("packer");
+    if(packer_it != end)
+    {
+        const auto name_it = std::find(std::begin(packer_names), std::end(packer_names), packer_it->second);
+        if(name_it == std::end(packer_names))
+            throw std::runtime_error("Invalid arguments, 'packer' must be skyline or maxrects.");
+        context.packer = Packer(name_it - std::begin(packer_names));
+    }
+
+    const auto pack_heuristic_it = options_table.find("pack_heuristic");
+    if(pack_heuristic_it != end)
+    {
+        const std::vector<std::string>& heuristic_names = PackHeuristicNames(context.packer);
+        const auto name_it = std::find(heuristic_names.begin(), heuristic_names.end(), pack_heuristic_it->second);
+        if(name_it == heuristic_names.end())
+            throw std::runtime_error("Invalid arguments, 'pack_heuristic' must be bl or bf for the skyline packer, or bssf, baf, bl or cp for maxrects.");
+        context.pack_heuristic = int(name_it - heuristic_names.begin());
+    }
+
+    const auto pack_order_it = options_table.find("pack_order");
+    if(pack_order_it != end)
+    {
+        const auto name_it = std::find(std::begin(pack_order_names), std::end(pack_order_names), pack_order_it->second);
+        if(name_it == std::end(pack_order_names))
+            throw std::runtime_error("Invalid arguments, 'pack_order' must be one of default, height, width, area, max_side or perimeter.");
+        context.pack_order = PackOrder(name_it - std::begin(pack_order_names));
+    }
+
+    context.pack_search = (options_table.find("pack_search") != end);
+
+    const auto scales_it = options_table.find("scales");
+    if(scales_it != end)
+    {
+        std::string scales_string = scales_it->second;
+        std::replace(scales_string.begin(), scales_string.end(), ',', ' ');
+
+        int scale = 0;
+        std::istringstream scales_stream(scales_string);
+        while(scales_stream >> scale)
+        {
+            const bool is_duplicate = std::find(context.scales.begin(), context.scales.end(), scale) != context.scales.end();
+            if(scale < 1 || is_duplicate)
+                throw std::runtime_error("Invalid arguments, 'scales' must be a list of different percentages.");
+            context.scales.push_back(scale);
+        }
+
+        if(context.scales.empty())
+            throw std::runtime_error("Invalid arguments, missing valid 'scales'.");
+        if(scale_argument != end)
+            throw std::runtime_error("Invalid arguments, use either 'scale' or 'scales'.");
+        if(context.write_sprite_format || !context.previous_layout.empty())
+            throw std::runtime_error("Invalid arguments, 'scales' can't be used with 'sprite_format' or 'previous_layout'.");
+    }
+
+    const auto mip_levels_it = options_table.find("mip_levels");
+    if(mip_levels_it != end)
+    {
+        context.mip_levels = std::stoi(mip_levels_it->second);
+        if(context.mip_levels < 1 || context.mip_levels > 15)
+            throw std::runtime_error("Invalid arguments, 'mip_levels' must be in the range 1 - 15.");
+        if(!context.previous_layout.empty())
+            throw std::runtime_error("Invalid arguments, 'mip_levels' can't be used with 'previous_layout'.");
+    }
+
+    const auto mip_coverage_it = options_table.find("mip_coverage");
+    if(mip_coverage_it != end)
+    {
+        context.mip_coverage_reference = mip_coverage_it->second.empty() ? 128 : std::stoi(mip_coverage_it->second);
+        if(context.mip_coverage_reference < 1 || context.mip_coverage_reference > 255)
+            throw std::runtime_error("Invalid arguments, 'mip_coverage' alpha reference must be in the range 1 - 255.");
+        if(context.mip_levels == 0)
+            throw std::runtime_error("Invalid arguments, 'mip_coverage' needs 'mip_levels'.");
+    }
+
+    context.proportional_layout = (options_table.find("proportional_layout") != end);
+    if(context.proportional_layout && context.scales.empty())
+        throw std::runtime_error("Invalid arguments, 'proportional_layout' needs 'scales'.");
+    if(context.proportional_layout && context.mip_levels > 0)
+        throw std::runtime_error("Invalid arguments, 'proportional_layout' can't be used with 'mip_levels'.");
+    if(context.proportional_layout && LayoutUnitPercentage(context.scales) < min_layout_unit_percentage)
+    {
+        throw std::runtime_error(
+            "Invalid arguments, 'proportional_layout' needs 'scales' with a common divisor of at least " +
+            std::to_string(min_layout_unit_percentage) + "%, like '200,100,50'.");
+    }
+
+    if(context.auto_size)
+    {
+        std::string constraint;
+        std::istringstream constraints_stream(auto_size_it->second);
+        while(constraints_stream >> constraint)
+        {
+            if(constraint == "pow2")
+                context.auto_size_pow2 = true;
+            else if(constraint == "square")
+                context.auto_size_square = true;
+            else
+                throw std::runtime_error("Invalid arguments, 'auto_size' constraints must be pow2 or square.");
+        }
+
+        if(!context.previous_layout.empty() || context.proportional_layout)
+            throw std::runtime_error("Invalid arguments, 'auto_size' can't be used with 'previous_layout' or 'proportional_layout'.");
+    }
+
+    const auto max_size_it = options_table.find("max_size");
+    if(max_size_it != end)
+    {
+        context.max_size = std::stoi(max_size_it->second);
+        if(context.max_size < 1 || context.max_size > 65536)
+            throw std::runtime_error("Invalid arguments, 'max_size' must be in the range 1 - 65536.");
+        if(!context.auto_size)
+            throw std::runtime_error("Invalid arguments, 'max_size' needs 'auto_size'.");
+    }
+
+    const auto size_multiple_it = options_table.find("size_multiple");
+    if(size_multiple_it != end)
+    {
+        context.size_multiple = std::stoi(size_multiple_it->second);
+        if(context.size_multiple < 1)
+            throw std::runtime_error("Invalid arguments, 'size_multiple' must be at least 1.");
+        if(!context.auto_size)
+            throw std::runtime_error("Invalid arguments, 'size_multiple' needs 'auto_size'.");
+    }
+
+    context.multi_page = (options_table.find("multi_page") != end);
+    if(context.multi_page && (!context.previous_layout.empty() || !context.scales.empty() || context.auto_size))
+        throw std::runtime_error("Invalid arguments, 'multi_page' can't be used with 'previous_layout', 'scales' or 'auto_size'.");
+
+    const auto jobs_it = options_table.find("jobs");
+    if(jobs_it != end)
+    {
+        context.jobs = std::stoi(jobs_it->second);
+        if(context.jobs < 1)
+            throw std::runtime_error("Invalid arguments, 'jobs' must be at least 1.");
+    }
 }
 
-void TrimImage(ImageData& image)
+// A ParallelFor call the threads of the pool can help with. 'helpers' is guarded by the mutex of the pool.
+struct ParallelLoop
 {
-    const size_t width_in_bytes = image.width * 4;
+    size_t count = 0;
+    const std::function<void(size_t)>* task = nullptr;
+    size_t max_helpers = 0;
+    size_t helpers = 0;
+    std::atomic<size_t> next_index = 0;
+    std::atomic<bool> failed = false;
+    std::vector<std::exception_ptr> errors;
+};
+
+// Runs the tasks of the loop that are left, until there are none or one has thrown.
+void RunParallelLoop(ParallelLoop& loop)
+{
+    while(!loop.failed)
+    {
+        const size_t index = loop.next_index++;
+        if(index >= loop.count)
+            break;
 
-    size_t first_non_transparent = std::numeric_limits<size_t>::max();
-    size_t last_non_transparent = 0;
+        try
+        {
+            (*loop.task)(index);
+        }
+        catch(...)
+        {
+            loop.errors[index] = std::current_exception();
+            loop.failed = true;
+        }
+    }
+}
 
-    size_t left_non_transparent = std::numeric_limits<size_t>::max();
-    size_t right_non_transparent = 0;
+// The threads that help with every ParallelFor call, started when first needed and reused for the rest of the
+// run, so there are never more than the largest number of jobs asked for, nested calls included.
+struct ThreadPool
+{
+    std::mutex mutex;
+    std::condition_variable work_added;
+    std::condition_variable helper_done;
+    std::vector<ParallelLoop*> loops;
+    std::vector<std::thread> threads;
+    bool stopping = false;
 
-    // First alpha component is at index 3 and the stride to next is 4
-    for(size_t index = 3; index < image.data.size(); index += 4)
+    ~ThreadPool()
     {
-        const unsigned char alpha = image.data[index];
-        if(alpha != 0)
         {
-            first_non_transparent = std::min(first_non_transparent, index);
-            last_non_transparent = std::max(last_non_transparent, index);
+            const std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        work_added.notify_all();
+        for(std::thread& thread : threads)
+            thread.join();
+    }
+};
 
-            const size_t current_row = index / width_in_bytes;
-            const size_t row_index = index - current_row * width_in_bytes;
+ThreadPool& GetThreadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
 
-            left_non_transparent = std::min(left_non_transparent, row_index);
-            right_non_transparent = std::max(right_non_transparent, row_index);
-        }
+// The oldest loop that has tasks left and room for another helper, the pool mutex must be held.
+ParallelLoop* FindHelpableLoop(const ThreadPool& pool)
+{
+    for(ParallelLoop* loop : pool.loops)
+    {
+        if(loop->helpers < loop->max_helpers && loop->next_index < loop->count && !loop->failed)
+            return loop;
+    }
+
+    return nullptr;
+}
+
+void HelpParallelLoops(ThreadPool& pool)
+{
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    while(true)
+    {
+        ParallelLoop* loop = nullptr;
+        pool.work_added.wait(lock, [&pool, &loop]() {
+            loop = FindHelpableLoop(pool);
+            return pool.stopping || loop;
+        });
+
+        if(pool.stopping)
+            return;
+
+        ++loop->helpers;
+        lock.unlock();
+        RunParallelLoop(*loop);
+        lock.lock();
+        --loop->helpers;
+
+        if(loop->helpers == 0)
+            pool.helper_done.notify_all();
+    }
+}
+
+// Runs task(index) for every index in [0, count) on at most 'jobs' threads, the calling thread and threads of the
+// pool. The calling thread always works on its own loop, so a task can call ParallelFor again without waiting on
+// threads that are busy elsewhere, and idle threads of the pool help with it. If any task throws, no new tasks are
+// started and the exception of the lowest failing index is rethrown, which is the same error the serial loop
+// would have reported since all lower indices have already been handed out.
+void ParallelFor(size_t count, int jobs, const std::function<void(size_t)>& task)
+{
+    const size_t thread_count = std::min(count, size_t(std::max(jobs, 1)));
+    if(thread_count <= 1)
+    {
+        for(size_t index = 0; index < count; ++index)
+            task(index);
+        return;
     }
 
-    // Correct the byte index to start at the red component
-    first_non_transparent -= 3;
-    last_non_transparent -= 3;
-    left_non_transparent -= 3;
-    right_non_transparent -= 3;
+    ParallelLoop loop;
+    loop.count = count;
+    loop.task = &task;
+    loop.max_helpers = thread_count - 1;
+    loop.errors.resize(count);
 
-    const size_t top_rows_to_delete = first_non_transparent / width_in_bytes;
-    const size_t bottom_rows_to_delete = image.height - (last_non_transparent / width_in_bytes) -1;
+    ThreadPool& pool = GetThreadPool();
+    {
+        const std::lock_guard<std::mutex> lock(pool.mutex);
+        while(pool.threads.size() < loop.max_helpers)
+            pool.threads.emplace_back(HelpParallelLoops, std::ref(pool));
 
-    const size_t bytes_to_copy = right_non_transparent - left_non_transparent + 4;
+        pool.loops.push_back(&loop);
+    }
 
-    ImageData trimmed_image;
-    trimmed_image.width = bytes_to_copy / 4;
-    trimmed_image.height = image.height - top_rows_to_delete - bottom_rows_to_delete;
-    trimmed_image.color_components = image.color_components;
-    trimmed_image.data.resize(trimmed_image.width * trimmed_image.height * 4);
+    pool.work_added.notify_all();
+    RunParallelLoop(loop);
 
-    for(size_t row = 0; row < size_t(trimmed_image.height); ++row)
     {
-        const size_t destination_offset = row * trimmed_image.width * 4;
-        const size_t source_offset = (row + top_rows_to_delete) * width_in_bytes;
-        void* dest = trimmed_image.data.data() + destination_offset;
-        const void* src = image.data.data() + source_offset + left_non_transparent;
-        std::memcpy(dest, src, bytes_to_copy);
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.loops.erase(std::find(pool.loops.begin(), pool.loops.end(), &loop));
+        pool.helper_done.wait(lock, [&loop]() { return loop.helpers == 0; });
     }
 
-    image = std::move(trimmed_image);
+    for(const std::exception_ptr& error : loop.errors)
+    {
+        if(error)
+            std::rethrow_exception(error);
+    }
 }
 
-void ScaleImage(ImageData& image, int scale_percentage)
+// The scanners find the first/last pixel with a non zero alpha in [begin, end) of an RGBA row. The first
+// returns 'end' and the last returns 'begin' if there is none, otherwise the last returns the index + 1.
+using FindOpaqueFunction = int (*)(const unsigned char* row, int begin, int end);
+
+int FindFirstOpaqueScalar(const unsigned char* row, int begin, int end)
 {
-    const float float_scale = float(scale_percentage) / 100.0f;
+    // Alpha is the fourth component of every pixel
+    for(int x = begin; x < end; ++x)
+    {
+        if(row[x * 4 + 3] != 0)
+            return x;
+    }
 
-    ImageData scaled_image;
-    scaled_image.width = image.width * float_scale;
-    scaled_image.height = image.height * float_scale;
-    scaled_image.color_components = image.color_components;
-    scaled_image.data.resize(scaled_image.width * scaled_image.height * image.color_components);
+    return end;
+}
 
-    const int result = stbir_resize_uint8(
-        image.data.data(), image.width, image.height, 0,
-        scaled_image.data.data(), scaled_image.width, scaled_image.height, 0, image.color_components);
+int FindLastOpaqueScalar(const unsigned char* row, int begin, int end)
+{
+    for(int x = end; x > begin; --x)
+    {
+        if(row[x * 4 - 1] != 0)
+            return x;
+    }
 
-    if(result == 0)
-        throw std::runtime_error("Failed to scale image");
+    return begin;
+}
 
-    image = std::move(scaled_image);
+#ifdef SPRITEBAKER_SSE2
+
+// The vector versions skip blocks of fully transparent pixels, 16 alpha bytes per test with SSE2 and 32
+// with AVX2, and hand the remaining pixels to the scalar version which then only scans the hit block.
+bool HasOpaquePixelsSSE2(const unsigned char* pixels)
+{
+    const __m128i alpha_mask = _mm_set1_epi32(int(0xFF000000));
+    const __m128i* block = reinterpret_cast<const __m128i*>(pixels);
+
+    const __m128i combined = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+        _mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3)));
+    const __m128i is_transparent = _mm_cmpeq_epi32(_mm_and_si128(combined, alpha_mask), _mm_setzero_si128());
+
+    return _mm_movemask_epi8(is_transparent) != 0xFFFF;
 }
 
-std::vector<ImageData> LoadImages(const std::vector<std::string>& image_files, bool trim_images, int scale_percentage)
+int FindFirstOpaqueSSE2(const unsigned char* row, int begin, int end)
 {
-    std::vector<ImageData> images;
-    images.reserve(image_files.size());
+    int x = begin;
+    for(; x + 16 <= end && !HasOpaquePixelsSSE2(row + x * 4); x += 16);
+
+    return FindFirstOpaqueScalar(row, x, end);
+}
+
+int FindLastOpaqueSSE2(const unsigned char* row, int begin, int end)
+{
+    int x = end;
+    for(; x - 16 >= begin && !HasOpaquePixelsSSE2(row + (x - 16) * 4); x -= 16);
+
+    return FindLastOpaqueScalar(row, begin, x);
+}
+
+SPRITEBAKER_TARGET_AVX2 bool HasOpaquePixelsAVX2(const unsigned char* pixels)
+{
+    const __m256i alpha_mask = _mm256_set1_epi32(int(0xFF000000));
+    const __m256i* block = reinterpret_cast<const __m256i*>(pixels);
+
+    const __m256i combined = _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256(block), _mm256_loadu_si256(block + 1)),
+        _mm256_or_si256(_mm256_loadu_si256(block + 2), _mm256_loadu_si256(block + 3)));
+
+    return !_mm256_testz_si256(combined, alpha_mask);
+}
+
+SPRITEBAKER_TARGET_AVX2 int FindFirstOpaqueAVX2(const unsigned char* row, int begin, int end)
+{
+    int x = begin;
+    for(; x + 32 <= end && !HasOpaquePixelsAVX2(row + x * 4); x += 32);
+
+    return FindFirstOpaqueSSE2(row, x, end);
+}
+
+SPRITEBAKER_TARGET_AVX2 int FindLastOpaqueAVX2(const unsigned char* row, int begin, int end)
+{
+    int x = end;
+    for(; x - 32 >= begin && !HasOpaquePixelsAVX2(row + (x - 32) * 4); x -= 32);
+
+    return FindLastOpaqueSSE2(row, begin, x);
+}
 
-    for(const std::string& file : image_files)
+bool HasAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    const bool has_os_support = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return has_os_support && (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+struct AlphaScanner
+{
+    FindOpaqueFunction find_first;
+    FindOpaqueFunction find_last;
+};
+
+// Picks the widest instruction set the cpu supports, once. The SPRITEBAKER_ALPHA_SCANNER environment variable
+// can narrow it to sse2 or scalar, so the tests can compare the versions.
+const AlphaScanner& GetAlphaScanner()
+{
+    static const AlphaScanner scanner = []() -> AlphaScanner {
+        const char* forced = std::getenv("SPRITEBAKER_ALPHA_SCANNER");
+        const std::string forced_scanner = forced ? forced : "";
+        if(forced_scanner == "scalar")
+            return { FindFirstOpaqueScalar, FindLastOpaqueScalar };
+
+#ifdef SPRITEBAKER_SSE2
+        if(HasAVX2() && forced_scanner != "sse2")
+            return { FindFirstOpaqueAVX2, FindLastOpaqueAVX2 };
+
+        return { FindFirstOpaqueSSE2, FindLastOpaqueSSE2 };
+#else
+        return { FindFirstOpaqueScalar, FindLastOpaqueScalar };
+#endif
+    }();
+
+    return scanner;
+}
+
+// Finds the bounding box of the pixels with a non zero alpha, right and bottom are exclusive and a fully
+// transparent image gives an empty box. The rows are scanned inwards from the top and bottom edges, and every
+// row in between is only scanned outside of the bounds found so far, so opaque interiors are never touched.
+AlphaBounds FindAlphaBounds(const ImageData& image)
+{
+    const AlphaScanner& scanner = GetAlphaScanner();
+
+    const auto row_pixels = [&image](int row) {
+        return ImageRow(image, row);
+    };
+
+    AlphaBounds bounds = { image.width, 0, 0, 0 };
+
+    for(; bounds.top < image.height; ++bounds.top)
     {
-        ImageData image;
+        bounds.left = scanner.find_first(row_pixels(bounds.top), 0, image.width);
+        if(bounds.left != image.width)
+            break;
+    }
 
-        // Force to 4 color components (RGBA).
-        constexpr int color_components = STBI_rgb_alpha;
-        stbi_uc* data = stbi_load(file.c_str(), &image.width, &image.height, &image.color_components, color_components);
-        if(!data)
-            throw std::runtime_error(stbi_failure_reason() + std::string(" '") + file + "'");
+    if(bounds.top == image.height)
+        return { 0, 0, 0, 0 };
 
-        const int image_size = image.width * image.height * color_components;
-        image.data.resize(image_size);
-        std::memcpy(image.data.data(), data, image_size);
+    for(bounds.bottom = image.height; bounds.bottom > bounds.top; --bounds.bottom)
+    {
+        bounds.right = scanner.find_last(row_pixels(bounds.bottom - 1), 0, image.width);
+        if(bounds.right != 0)
+            break;
+    }
 
-        if(scale_percentage != 100)
-            ScaleImage(image, scale_percentage);
+    for(int row = bounds.top; row < bounds.bottom; ++row)
+    {
+        const unsigned char* row_data = row_pixels(row);
+        bounds.left = scanner.find_first(row_data, 0, bounds.left);
+        bounds.right = scanner.find_last(row_data, bounds.right, image.width);
+    }
+
+    return bounds;
+}
+
+// Trimming only narrows the view, the pixels are copied once when the image is written to the output image.
+void TrimImage(ImageData& image)
+{
+    const AlphaBounds& bounds = FindAlphaBounds(image);
+
+    const int trimmed_width = bounds.right - bounds.left;
+    const int trimmed_height = bounds.bottom - bounds.top;
+
+    // Nothing to trim, keep the view as is.
+    if(trimmed_width == image.width && trimmed_height == image.height)
+        return;
 
-        if(trim_images)
-            TrimImage(image);
+    const unsigned char* first_pixel = ImageRow(image, bounds.top) + bounds.left * 4;
+    image.data = PixelBuffer(image.data, const_cast<unsigned char*>(first_pixel));
+    image.width = trimmed_width;
+    image.height = trimmed_height;
+    image.offset_x += bounds.left;
+    image.offset_y += bounds.top;
+}
+
+float Cross(const MeshVertex& origin, const MeshVertex& first, const MeshVertex& second)
+{
+    return (first.x - origin.x) * (second.y - origin.y) - (first.y - origin.y) * (second.x - origin.x);
+}
+
+// Convex hull of the pixel corners of the first and last non transparent pixel on every row, found with the
+// same scanners as the trim bounds. Monotone chain, the hull is counter clockwise without collinear points.
+std::vector<MeshVertex> FindConvexOutline(const ImageData& image)
+{
+    const AlphaScanner& scanner = GetAlphaScanner();
+
+    std::vector<MeshVertex> points;
+    for(int row = 0; row < image.height; ++row)
+    {
+        const unsigned char* row_pixels = ImageRow(image, row);
+        const int left = scanner.find_first(row_pixels, 0, image.width);
+        if(left == image.width)
+            continue;
 
-        images.push_back(std::move(image));
-        stbi_image_free(data);
+        const int right = scanner.find_last(row_pixels, left, image.width);
+        const float top = float(row);
+        const float bottom = float(row + 1);
+        points.insert(points.end(), { { float(left), top }, { float(right), top }, { float(left), bottom }, { float(right), bottom } });
     }
 
-    return images;
+    if(points.empty())
+        return points;
+
+    const auto by_position = [](const MeshVertex& first, const MeshVertex& second) {
+        return first.x < second.x || (first.x == second.x && first.y < second.y);
+    };
+    std::sort(points.begin(), points.end(), by_position);
+
+    std::vector<MeshVertex> hull(points.size() * 2);
+    size_t hull_size = 0;
+
+    for(size_t index = 0; index < points.size(); ++index)
+    {
+        while(hull_size >= 2 && Cross(hull[hull_size - 2], hull[hull_size - 1], points[index]) <= 0.0f)
+            --hull_size;
+        hull[hull_size++] = points[index];
+    }
+
+    const size_t lower_size = hull_size + 1;
+    for(size_t index = points.size() - 1; index > 0; --index)
+    {
+        while(hull_size >= lower_size && Cross(hull[hull_size - 2], hull[hull_size - 1], points[index - 1]) <= 0.0f)
+            --hull_size;
+        hull[hull_size++] = points[index - 1];
+    }
+
+    // The last point is the same as the first one.
+    hull.resize(hull_size - 1);
+    return hull;
 }
 
-std::vector<stbrp_rect> PackImages(const std::vector<ImageData>& images, int width, int height, int padding)
-{
-    std::vector<stbrp_rect> pack_rects;
-    pack_rects.reserve(images.size());
+// Reduces a convex outline to 'max_vertices' while still containing all of it. An edge is removed by extending
+// its two neighbouring edges until they meet, always picking the edge that adds the least area and never growing
+// the outline outside of the frame, so the mesh never samples the neighbouring sprites. If no edge can be removed
+// before reaching 'max_vertices' the outline is replaced by its bounding rect, so 'max_vertices' must be at least 4.
+void SimplifyConvexOutline(std::vector<MeshVertex>& outline, int max_vertices, int width, int height)
+{
+    constexpr float epsilon = 1e-3f;
+
+    while(outline.size() > size_t(max_vertices))
+    {
+        const size_t count = outline.size();
+
+        float best_area = std::numeric_limits<float>::max();
+        size_t best_edge = count;
+        MeshVertex best_point = {};
+
+        for(size_t index = 0; index < count; ++index)
+        {
+            const MeshVertex& previous = outline[(index + count - 1) % count];
+            const MeshVertex& first = outline[index];
+            const MeshVertex& second = outline[(index + 1) % count];
+            const MeshVertex& next = outline[(index + 2) % count];
+
+            // Intersect the line previous -> first with the line next -> second.
+            const MeshVertex direction_1 = { first.x - previous.x, first.y - previous.y };
+            const MeshVertex direction_2 = { second.x - next.x, second.y - next.y };
+            const float denominator = direction_1.x * direction_2.y - direction_1.y * direction_2.x;
+            if(std::abs(denominator) < epsilon)
+                continue;
+
+            const float t = ((next.x - previous.x) * direction_2.y - (next.y - previous.y) * direction_2.x) / denominator;
+            const float u = ((next.x - previous.x) * direction_1.y - (next.y - previous.y) * direction_1.x) / denominator;
+            if(t < 1.0f || u < 1.0f)
+                continue;
+
+            const MeshVertex point = { previous.x + direction_1.x * t, previous.y + direction_1.y * t };
+            const bool is_inside_frame =
+                point.x >= -epsilon && point.y >= -epsilon && point.x <= width + epsilon && point.y <= height + epsilon;
+            if(!is_inside_frame)
+                continue;
+
+            const float added_area = std::abs(Cross(first, point, second)) / 2.0f;
+            if(added_area < best_area)
+            {
+                best_area = added_area;
+                best_edge = index;
+                best_point = { std::clamp(point.x, 0.0f, float(width)), std::clamp(point.y, 0.0f, float(height)) };
+            }
+        }
+
+        if(best_edge == count)
+        {
+            MeshVertex min = outline.front();
+            MeshVertex max = outline.front();
+            for(const MeshVertex& vertex : outline)
+            {
+                min = { std::min(min.x, vertex.x), std::min(min.y, vertex.y) };
+                max = { std::max(max.x, vertex.x), std::max(max.y, vertex.y) };
+            }
+
+            // Same winding as the convex hull.
+            outline = { { min.x, min.y }, { max.x, min.y }, { max.x, max.y }, { min.x, max.y } };
+            break;
+        }
+
+        outline[best_edge] = best_point;
+        outline.erase(outline.begin() + (best_edge + 1) % count);
+    }
+}
+
+void BuildPolygonMesh(const ImageData& image, int max_vertices, FrameInfo& frame)
+{
+    frame.mesh_vertices = FindConvexOutline(image);
+    SimplifyConvexOutline(frame.mesh_vertices, max_vertices, image.width, image.height);
+
+    // A convex polygon is a triangle fan.
+    frame.mesh_indices.clear();
+    for(size_t index = 2; index < frame.mesh_vertices.size(); ++index)
+        frame.mesh_indices.insert(frame.mesh_indices.end(), { 0, int(index - 1), int(index) });
+}
+
+// Largest rectangle of alpha == 255 pixels. Every row updates the height of the opaque column above each pixel
+// and finds the largest rectangle in that histogram with a stack, so the whole image is O(w * h).
+AlphaBounds FindOpaqueRect(const ImageData& image)
+{
+    std::vector<int> heights(image.width + 1, 0);
+    std::vector<int> stack;
+    stack.reserve(image.width + 1);
+
+    AlphaBounds best = {};
+    int best_area = 0;
+
+    for(int row = 0; row < image.height; ++row)
+    {
+        const unsigned char* row_pixels = ImageRow(image, row);
+        for(int x = 0; x < image.width; ++x)
+            heights[x] = (row_pixels[x * 4 + 3] == 255) ? heights[x] + 1 : 0;
+
+        // The extra zero column at the end flushes the stack.
+        stack.clear();
+        for(int x = 0; x <= image.width; ++x)
+        {
+            while(!stack.empty() && heights[stack.back()] >= heights[x])
+            {
+                const int height = heights[stack.back()];
+                stack.pop_back();
+
+                const int left = stack.empty() ? 0 : stack.back() + 1;
+                const int area = height * (x - left);
+                if(area > best_area)
+                {
+                    best_area = area;
+                    best = { left, row + 1 - height, x, row + 1 };
+                }
+            }
+
+            stack.push_back(x);
+        }
+    }
+
+    return best;
+}
+
+// One bit per pixel, set where the alpha is at or above the threshold. Every row starts on a new 64 bit word
+// and pixel x is bit (x % 64) of word (x / 64).
+std::vector<uint64_t> BuildHitMask(const ImageData& image, int threshold)
+{
+    const int row_words = (image.width + 63) / 64;
+    std::vector<uint64_t> mask(size_t(row_words) * image.height, 0);
+
+    for(int row = 0; row < image.height; ++row)
+    {
+        const unsigned char* row_pixels = ImageRow(image, row);
+        uint64_t* row_mask = mask.data() + size_t(row) * row_words;
+
+        for(int x = 0; x < image.width; ++x)
+        {
+            const uint64_t is_set = (row_pixels[x * 4 + 3] >= threshold);
+            row_mask[x / 64] |= is_set << (x % 64);
+        }
+    }
+
+    return mask;
+}
+
+int ScaledSize(int size, int scale_percentage)
+{
+    const float float_scale = float(scale_percentage) / 100.0f;
+    return size * float_scale;
+}
+
+// Smallest band of output rows worth a job of its own, every band redoes the horizontal pass of the few input
+// rows it shares with its neighbours.
+constexpr int scale_band_rows = 32;
+
+// Reach of the default resize filters (Catmull-Rom up, Mitchell down) in pixels of the lower of the two resolutions.
+constexpr float scale_filter_support = 2.0f;
+
+// destination[i] = source[(first + i) / factor], every source pixel is repeated 'factor' times.
+void ReplicateRow(const unsigned char* source, unsigned char* destination, int first, int count, int factor)
+{
+    int index = 0;
+
+    // Up to the first whole block of copies.
+    for(; index < count && (first + index) % factor != 0; ++index)
+        std::memcpy(destination + index * 4, source + (first + index) / factor * 4, 4);
+
+#ifdef SPRITEBAKER_SSE2
+    if(factor == 2)
+    {
+        for(; index + 8 <= count; index += 8)
+        {
+            const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + (first + index) / 2 * 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + index * 4), _mm_unpacklo_epi32(pixels, pixels));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + index * 4 + 16), _mm_unpackhi_epi32(pixels, pixels));
+        }
+    }
+    else
+    {
+        // Whole blocks with four pixels per store, the last store of a block overlaps into the next block
+        // which overwrites it again.
+        const int stored_pixels = (factor + 3) / 4 * 4;
+        for(; index + stored_pixels <= count; index += factor)
+        {
+            int32_t pixel;
+            std::memcpy(&pixel, source + (first + index) / factor * 4, 4);
+            const __m128i pixels = _mm_set1_epi32(pixel);
+            for(int copy = 0; copy < factor; copy += 4)
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + (index + copy) * 4), pixels);
+        }
+    }
+#endif
+
+    for(; index < count; ++index)
+        std::memcpy(destination + index * 4, source + (first + index) / factor * 4, 4);
+}
+
+// Every destination pixel is the rounded average of a factor x factor block of the source rows, factor 2 or 4.
+void BoxDownsampleRow(const unsigned char* const* source_rows, unsigned char* destination, int first, int count, int factor)
+{
+    int index = 0;
+
+#ifdef SPRITEBAKER_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    if(factor == 2)
+    {
+        const __m128i rounding = _mm_set1_epi16(2);
+        for(; index + 2 <= count; index += 2)
+        {
+            const size_t offset = size_t(first + index) * 2 * 4;
+            const __m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source_rows[0] + offset));
+            const __m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source_rows[1] + offset));
+
+            // Column sums of pixels 0 1 and 2 3, then the two columns of each block added together.
+            const __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+            const __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+            __m128i sums = _mm_add_epi16(_mm_unpacklo_epi64(low, high), _mm_unpackhi_epi64(low, high));
+
+            sums = _mm_srli_epi16(_mm_add_epi16(sums, rounding), 2);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(destination + index * 4), _mm_packus_epi16(sums, sums));
+        }
+    }
+    else
+    {
+        const __m128i rounding = _mm_set1_epi16(8);
+        for(; index < count; ++index)
+        {
+            const size_t offset = size_t(first + index) * 4 * 4;
+
+            __m128i low = zero;
+            __m128i high = zero;
+            for(int row = 0; row < 4; ++row)
+            {
+                const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source_rows[row] + offset));
+                low = _mm_add_epi16(low, _mm_unpacklo_epi8(pixels, zero));
+                high = _mm_add_epi16(high, _mm_unpackhi_epi8(pixels, zero));
+            }
+
+            __m128i sums = _mm_add_epi16(low, high);
+            sums = _mm_add_epi16(sums, _mm_srli_si128(sums, 8));
+            sums = _mm_srli_epi16(_mm_add_epi16(sums, rounding), 4);
+
+            const int pixel = _mm_cvtsi128_si32(_mm_packus_epi16(sums, sums));
+            std::memcpy(destination + index * 4, &pixel, 4);
+        }
+    }
+#endif
+
+    const int block_size = factor * factor;
+    for(; index < count; ++index)
+    {
+        for(int component = 0; component < 4; ++component)
+        {
+            int sum = 0;
+            for(int row = 0; row < factor; ++row)
+            {
+                for(int column = 0; column < factor; ++column)
+                    sum += source_rows[row][(size_t(first + index) * factor + column) * 4 + component];
+            }
+
+            destination[index * 4 + component] = (sum + block_size / 2) / block_size;
+        }
+    }
+}
+
+// Integer factor from 'size' to 'scaled_size', 0 if it isn't one or either size is empty.
+int IntegerScaleFactor(int size, int scaled_size)
+{
+    if(size == 0 || scaled_size == 0)
+        return 0;
+
+    return (scaled_size % size == 0) ? scaled_size / size : 0;
+}
+
+// Resizes 'image' to 'scaled_width' x 'scaled_height' but only produces the 'region' of the scaled image. With
+// 'srgb' or 'premultiply_alpha' the colors are weighted by alpha, so transparent pixels don't bleed into the
+// visible ones, and with 'srgb' they're also filtered in linear light.
+// The nearest and box filters copy pixels for integer upscales and average 2x2 or 4x4 blocks for 50% and 25%,
+// any other ratio goes through the filtered resize with the closest filter.
+// Large regions are resized in bands of output rows on several jobs. Every band is resized from the whole input
+// image, shifted so its first pixel lands in place, which gives the same filter weights and edge handling as
+// resizing the whole image at once, so the output doesn't depend on the region or the number of jobs.
+ImageData ScaleImageRegion(const ImageData& image, int scaled_width, int scaled_height, const AlphaBounds& region, const Context& context, int jobs)
+{
+    ImageData scaled_image;
+    scaled_image.width = region.right - region.left;
+    scaled_image.height = region.bottom - region.top;
+    scaled_image.color_components = image.color_components;
+    scaled_image.stride = scaled_image.width * image.color_components;
+    scaled_image.data = AllocatePixels(size_t(scaled_image.stride) * scaled_image.height);
+    scaled_image.source_width = scaled_width;
+    scaled_image.source_height = scaled_height;
+    scaled_image.offset_x = region.left;
+    scaled_image.offset_y = region.top;
+
+    // Sides that scale down to 0 pixels leave nothing to resize.
+    if(scaled_image.width == 0 || scaled_image.height == 0)
+        return scaled_image;
+
+    const float x_scale = float(scaled_width) / image.width;
+    const float y_scale = float(scaled_height) / image.height;
+
+    const bool is_alpha_weighted = context.srgb || context.premultiply_alpha;
+    const int alpha_channel = is_alpha_weighted ? 3 : STBIR_ALPHA_CHANNEL_NONE;
+    const stbir_colorspace color_space = context.srgb ? STBIR_COLORSPACE_SRGB : STBIR_COLORSPACE_LINEAR;
+    const stbir_filter filter = (context.scale_filter == ScaleFilter::Box) ? STBIR_FILTER_BOX : STBIR_FILTER_DEFAULT;
+
+    // The default filter always goes through the filtered resize, which also handles scaled sizes of 0.
+    const bool is_pixel_art = (context.scale_filter != ScaleFilter::Default);
+    const int upscale_factor = is_pixel_art ? IntegerScaleFactor(image.width, scaled_width) : 0;
+    const int downscale_factor = is_pixel_art ? IntegerScaleFactor(scaled_width, image.width) : 0;
+
+    const bool is_replicated =
+        is_pixel_art && upscale_factor > 0 && upscale_factor == IntegerScaleFactor(image.height, scaled_height);
+    const bool is_box_downsampled = context.scale_filter == ScaleFilter::Box && !is_alpha_weighted &&
+        (downscale_factor == 2 || downscale_factor == 4) && downscale_factor == IntegerScaleFactor(scaled_height, image.height);
+    const bool is_nearest = context.scale_filter == ScaleFilter::Nearest;
+    const bool is_copied = is_replicated || is_box_downsampled || is_nearest;
+
+    // Source column of every scaled column in the region, for the nearest filter at any ratio.
+    std::vector<int> nearest_columns;
+    if(is_nearest && !is_replicated)
+    {
+        for(int x = region.left; x < region.right; ++x)
+            nearest_columns.push_back(std::min(int((x + 0.5) * image.width / scaled_width), image.width - 1));
+    }
+
+    // The box filter's weights at the edges of its box round differently when shifted, so it resizes the
+    // whole image in one go and copies the region out of it.
+    const bool is_whole_resize = !is_copied && filter == STBIR_FILTER_BOX;
+
+    const int max_bands = std::max(scaled_image.height / scale_band_rows, 1);
+    const int band_count = is_whole_resize ? 1 : std::clamp(jobs, 1, max_bands);
+
+    std::vector<int> results(band_count, 1);
+    const auto scale_band = [&](size_t band) {
+        const int first_row = int(scaled_image.height * band / band_count);
+        const int end_row = int(scaled_image.height * (band + 1) / band_count);
+
+        if(is_whole_resize)
+        {
+            std::vector<unsigned char> scaled_pixels(size_t(scaled_width) * scaled_height * 4);
+            results[band] = stbir_resize(
+                image.data.get(), image.width, image.height, image.stride, scaled_pixels.data(), scaled_width, scaled_height, 0,
+                STBIR_TYPE_UINT8, image.color_components, alpha_channel, 0,
+                STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, filter, filter, color_space, nullptr);
+
+            for(int row = 0; row < scaled_image.height; ++row)
+            {
+                const unsigned char* source = &scaled_pixels[(size_t(region.top + row) * scaled_width + region.left) * 4];
+                std::memcpy(scaled_image.data.get() + size_t(row) * scaled_image.stride, source, scaled_image.stride);
+            }
+            return;
+        }
+
+        if(!is_copied)
+        {
+            results[band] = stbir_resize_subpixel(
+                image.data.get(), image.width, image.height, image.stride,
+                scaled_image.data.get() + size_t(first_row) * scaled_image.stride, scaled_image.width, end_row - first_row, scaled_image.stride,
+                STBIR_TYPE_UINT8, image.color_components, alpha_channel, 0,
+                STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, filter, filter, color_space, nullptr,
+                x_scale, y_scale, float(region.left), float(region.top + first_row));
+            return;
+        }
+
+        for(int row = first_row; row < end_row; ++row)
+        {
+            const int y = region.top + row;
+            unsigned char* destination = scaled_image.data.get() + size_t(row) * scaled_image.stride;
+
+            if(is_replicated)
+            {
+                // Rows of the same source row are identical.
+                if(row > first_row && (y - 1) / upscale_factor == y / upscale_factor)
+                    std::memcpy(destination, destination - scaled_image.stride, scaled_image.stride);
+                else
+                    ReplicateRow(ImageRow(image, y / upscale_factor), destination, region.left, scaled_image.width, upscale_factor);
+            }
+            else if(is_box_downsampled)
+            {
+                const unsigned char* source_rows[4];
+                for(int block_row = 0; block_row < downscale_factor; ++block_row)
+                    source_rows[block_row] = ImageRow(image, y * downscale_factor + block_row);
+                BoxDownsampleRow(source_rows, destination, region.left, scaled_image.width, downscale_factor);
+            }
+            else
+            {
+                const int source_y = std::min(int((y + 0.5) * image.height / scaled_height), image.height - 1);
+                const unsigned char* source = ImageRow(image, source_y);
+                for(int x = 0; x < scaled_image.width; ++x)
+                    std::memcpy(destination + x * 4, source + nearest_columns[x] * 4, 4);
+            }
+        }
+    };
+    ParallelFor(band_count, jobs, scale_band);
+
+    if(std::find(results.begin(), results.end(), 0) != results.end())
+        throw std::runtime_error("Failed to scale image");
+
+    return scaled_image;
+}
+
+void ScaleImage(ImageData& image, const Context& context, int jobs)
+{
+    const int scaled_width = ScaledSize(image.width, context.scale_in_percentage);
+    const int scaled_height = ScaledSize(image.height, context.scale_in_percentage);
+    image = ScaleImageRegion(image, scaled_width, scaled_height, { 0, 0, scaled_width, scaled_height }, context, jobs);
+}
+
+// The scaled pixels whose filter reaches into [first, last) of the source, conservatively rounded outwards.
+void ScaledRange(int first, int last, int size, int scaled_size, int& scaled_first, int& scaled_last)
+{
+    const float scale = float(scaled_size) / size;
+    const float support = (scale < 1.0f) ? scale_filter_support / scale : scale_filter_support;
+
+    scaled_first = std::max(int(std::floor((first - support) * scale)) - 1, 0);
+    scaled_last = std::min(int(std::ceil((last + support) * scale)) + 1, scaled_size);
+}
+
+// Same result as scaling and then trimming, but only the scaled pixels that can see a non transparent source
+// pixel are resized. The alpha channel is filtered on its own, so everything outside of that region ends up
+// fully transparent and would be trimmed anyway. The exact trim happens on the resized region.
+void ScaleAndTrimImage(ImageData& image, const Context& context, int jobs)
+{
+    const AlphaBounds& bounds = FindAlphaBounds(image);
+    const int scaled_width = ScaledSize(image.width, context.scale_in_percentage);
+    const int scaled_height = ScaledSize(image.height, context.scale_in_percentage);
+
+    // Nothing to narrow down for an empty image or scaled size, and ScaledRange needs a scale above 0.
+    if(bounds.right == bounds.left || scaled_width == 0 || scaled_height == 0)
+    {
+        ScaleImage(image, context, jobs);
+        TrimImage(image);
+        return;
+    }
+
+    AlphaBounds region;
+    ScaledRange(bounds.left, bounds.right, image.width, scaled_width, region.left, region.right);
+    ScaledRange(bounds.top, bounds.bottom, image.height, scaled_height, region.top, region.bottom);
+
+    image = ScaleImageRegion(image, scaled_width, scaled_height, region, context, jobs);
+    TrimImage(image);
+
+    // Faint pixels can vanish in the scaling, an empty image is at the origin like any other trimmed empty image.
+    if(image.width == 0 || image.height == 0)
+    {
+        image.offset_x = 0;
+        image.offset_y = 0;
+    }
+}
+
+// xxHash64 (https://github.com/Cyan4973/xxHash), hashes 32 bytes per round on four independent lanes.
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 0)
+{
+    constexpr uint64_t prime_1 = 11400714785074694791ull;
+    constexpr uint64_t prime_2 = 14029467366897019727ull;
+    constexpr uint64_t prime_3 = 1609587929392839161ull;
+    constexpr uint64_t prime_4 = 9650029242287828579ull;
+    constexpr uint64_t prime_5 = 2870177450012600261ull;
+
+    const auto rotate_left = [](uint64_t value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    };
+    const auto round = [&](uint64_t accumulator, uint64_t input) {
+        accumulator += input * prime_2;
+        return rotate_left(accumulator, 31) * prime_1;
+    };
+    const auto merge_round = [&](uint64_t accumulator, uint64_t value) {
+        accumulator ^= round(0, value);
+        return accumulator * prime_1 + prime_4;
+    };
+    const auto read_64 = [](const unsigned char* bytes) {
+        uint64_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+        return value;
+    };
+    const auto read_32 = [](const unsigned char* bytes) {
+        uint32_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+        return uint64_t(value);
+    };
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    const unsigned char* const bytes_end = bytes + size;
+    uint64_t hash;
+
+    if(size >= 32)
+    {
+        uint64_t lane_1 = seed + prime_1 + prime_2;
+        uint64_t lane_2 = seed + prime_2;
+        uint64_t lane_3 = seed;
+        uint64_t lane_4 = seed - prime_1;
+
+        for(; bytes + 32 <= bytes_end; bytes += 32)
+        {
+            lane_1 = round(lane_1, read_64(bytes));
+            lane_2 = round(lane_2, read_64(bytes + 8));
+            lane_3 = round(lane_3, read_64(bytes + 16));
+            lane_4 = round(lane_4, read_64(bytes + 24));
+        }
+
+        hash = rotate_left(lane_1, 1) + rotate_left(lane_2, 7) + rotate_left(lane_3, 12) + rotate_left(lane_4, 18);
+        hash = merge_round(hash, lane_1);
+        hash = merge_round(hash, lane_2);
+        hash = merge_round(hash, lane_3);
+        hash = merge_round(hash, lane_4);
+    }
+    else
+    {
+        hash = seed + prime_5;
+    }
+
+    hash += size;
+
+    for(; bytes + 8 <= bytes_end; bytes += 8)
+        hash = rotate_left(hash ^ round(0, read_64(bytes)), 27) * prime_1 + prime_4;
+
+    if(bytes + 4 <= bytes_end)
+    {
+        hash = rotate_left(hash ^ (read_32(bytes) * prime_1), 23) * prime_2 + prime_3;
+        bytes += 4;
+    }
+
+    for(; bytes < bytes_end; ++bytes)
+        hash = rotate_left(hash ^ (*bytes * prime_5), 11) * prime_1;
+
+    hash ^= hash >> 33;
+    hash *= prime_2;
+    hash ^= hash >> 29;
+    hash *= prime_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+std::string ToHexString(uint64_t value)
+{
+    std::ostringstream stream;
+    stream << std::hex << std::setw(16) << std::setfill('0') << value;
+    return stream.str();
+}
+
+std::vector<unsigned char> ReadFileBytes(const std::string& file)
+{
+    std::ifstream input_stream(file, std::ios::binary);
+    if(!input_stream)
+        throw std::runtime_error("Unable to open '" + file + "'");
+
+    std::vector<unsigned char> bytes(std::filesystem::file_size(file));
+    input_stream.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+    if(!input_stream)
+        throw std::runtime_error("Unable to read '" + file + "'");
+
+    return bytes;
+}
+
+// Maps a whole file read only into memory, returns null if the file can't be mapped.
+PixelBuffer MapFile(const std::string& file, size_t& file_size)
+{
+#ifdef _WIN32
+    std::error_code error;
+    file_size = std::filesystem::file_size(file, error);
+    if(error || file_size == 0)
+        return nullptr;
+
+    std::ifstream input_stream(file, std::ios::binary);
+    PixelBuffer data = AllocatePixels(file_size);
+    if(!input_stream.read(reinterpret_cast<char*>(data.get()), file_size))
+        return nullptr;
+
+    return data;
+#else
+    const int file_descriptor = open(file.c_str(), O_RDONLY);
+    if(file_descriptor < 0)
+        return nullptr;
+
+    struct stat file_stat;
+    const bool has_size = fstat(file_descriptor, &file_stat) == 0 && file_stat.st_size > 0;
+    file_size = has_size ? size_t(file_stat.st_size) : 0;
+
+    void* mapped = has_size ? mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0) : MAP_FAILED;
+    close(file_descriptor);
+
+    if(mapped == MAP_FAILED)
+        return nullptr;
+
+    const size_t mapped_size = file_size;
+    return PixelBuffer(static_cast<unsigned char*>(mapped), [mapped_size](unsigned char* data) { munmap(data, mapped_size); });
+#endif
+}
+
+// Cached images are a fixed size header followed by the tightly packed RGBA rows, so a cache hit is a
+// single mmap and the pixels are used in place.
+constexpr uint32_t image_cache_version = 2;
+constexpr size_t image_cache_header_size = 64;
+
+struct ImageCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    int32_t width;
+    int32_t height;
+    int32_t source_width;
+    int32_t source_height;
+    int32_t offset_x;
+    int32_t offset_y;
+};
+
+static_assert(sizeof(ImageCacheHeader) <= image_cache_header_size);
+
+uint64_t ImageCacheKey(const std::vector<unsigned char>& file_bytes, const Context& context)
+{
+    const int32_t settings[] = {
+        int32_t(image_cache_version),
+        context.scale_in_percentage,
+        context.trim_images,
+        context.srgb,
+        context.premultiply_alpha,
+        int32_t(context.scale_filter)
+    };
+
+    return HashBytes(settings, sizeof(settings), HashBytes(file_bytes.data(), file_bytes.size()));
+}
+
+std::string ImageCacheFile(const std::string& cache_dir, uint64_t key)
+{
+    const std::string& hex_key = ToHexString(key);
+    return cache_dir + "/" + hex_key.substr(0, 2) + "/" + hex_key + ".sbimg";
+}
+
+bool ReadCachedImage(const std::string& cache_file, uint64_t key, ImageData& image)
+{
+    size_t file_size = 0;
+    const PixelBuffer mapped_file = MapFile(cache_file, file_size);
+    if(!mapped_file || file_size < image_cache_header_size)
+        return false;
+
+    ImageCacheHeader header;
+    std::memcpy(&header, mapped_file.get(), sizeof(header));
+
+    const bool valid_header =
+        std::memcmp(header.magic, "SBIC", 4) == 0 &&
+        header.version == image_cache_version &&
+        header.key == key &&
+        header.width >= 0 && header.height >= 0 &&
+        file_size == image_cache_header_size + size_t(header.width) * header.height * 4;
+    if(!valid_header)
+        return false;
+
+    image.width = header.width;
+    image.height = header.height;
+    image.color_components = 4;
+    image.stride = image.width * 4;
+    image.source_width = header.source_width;
+    image.source_height = header.source_height;
+    image.offset_x = header.offset_x;
+    image.offset_y = header.offset_y;
+
+    // Points at the pixels but keeps the whole mapping alive.
+    image.data = PixelBuffer(mapped_file, mapped_file.get() + image_cache_header_size);
+    return true;
+}
+
+void WriteCachedImage(const std::string& cache_file, uint64_t key, const ImageData& image)
+{
+    ImageCacheHeader header = {};
+    std::memcpy(header.magic, "SBIC", 4);
+    header.version = image_cache_version;
+    header.key = key;
+    header.width = image.width;
+    header.height = image.height;
+    header.source_width = image.source_width;
+    header.source_height = image.source_height;
+    header.offset_x = image.offset_x;
+    header.offset_y = image.offset_y;
+
+    unsigned char header_bytes[image_cache_header_size] = {};
+    std::memcpy(header_bytes, &header, sizeof(header));
+
+    // Write to a unique temporary file and rename it into place, concurrent bakes never see a partial entry.
+    const std::string temp_file = cache_file + ".tmp" + ToHexString(std::random_device()());
+
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(cache_file).parent_path(), error);
+
+    {
+        std::ofstream out_file(temp_file, std::ios::binary);
+        out_file.write(reinterpret_cast<const char*>(header_bytes), sizeof(header_bytes));
+        for(int row = 0; row < image.height; ++row)
+            out_file.write(reinterpret_cast<const char*>(ImageRow(image, row)), size_t(image.width) * 4);
+        if(!out_file)
+        {
+            out_file.close();
+            std::filesystem::remove(temp_file, error);
+            std::printf("Unable to write image cache file '%s'\n", cache_file.c_str());
+            return;
+        }
+    }
+
+    std::filesystem::rename(temp_file, cache_file, error);
+    if(error)
+        std::filesystem::remove(temp_file, error);
+}
+
+ImageData DecodeImage(const std::string& file, const std::vector<unsigned char>* file_bytes)
+{
+    ImageData image;
+
+    // Force to 4 color components (RGBA).
+    constexpr int color_components = STBI_rgb_alpha;
+    stbi_uc* data = file_bytes ?
+        stbi_load_from_memory(file_bytes->data(), file_bytes->size(), &image.width, &image.height, &image.color_components, color_components) :
+        stbi_load(file.c_str(), &image.width, &image.height, &image.color_components, color_components);
+    if(!data)
+    {
+        // The failure reason is thread local, so this is the reason for this file.
+        throw std::runtime_error(stbi_failure_reason() + std::string(" '") + file + "'");
+    }
+
+    // Take ownership of the decoded pixels, no copy needed.
+    image.data = AdoptPixels(data);
+    image.color_components = color_components;
+    image.stride = image.width * color_components;
+    image.source_width = image.width;
+    image.source_height = image.height;
+    image.offset_x = 0;
+    image.offset_y = 0;
+
+    return image;
+}
+
+// 'jobs' is the number of threads this image may use on its own.
+void ProcessImage(ImageData& image, const Context& context, int jobs)
+{
+    const bool is_scaled = (context.scale_in_percentage != 100);
+
+    if(is_scaled && context.trim_images)
+        ScaleAndTrimImage(image, context, jobs);
+    else if(is_scaled)
+        ScaleImage(image, context, jobs);
+    else if(context.trim_images)
+        TrimImage(image);
+}
+
+ImageData LoadImage(const std::string& file, const Context& context, int jobs)
+{
+    if(context.cache_dir.empty())
+    {
+        ImageData image = DecodeImage(file, nullptr);
+        ProcessImage(image, context, jobs);
+        return image;
+    }
+
+    const std::vector<unsigned char>& file_bytes = ReadFileBytes(file);
+    const uint64_t key = ImageCacheKey(file_bytes, context);
+    const std::string& cache_file = ImageCacheFile(context.cache_dir, key);
+
+    ImageData image;
+    if(ReadCachedImage(cache_file, key, image))
+        return image;
+
+    image = DecodeImage(file, &file_bytes);
+    ProcessImage(image, context, jobs);
+    WriteCachedImage(cache_file, key, image);
+
+    return image;
+}
+
+// The jobs left over when there are fewer images than jobs, for the work inside of a single image.
+int JobsPerImage(const Context& context, size_t image_count)
+{
+    return std::max(context.jobs / int(std::max<size_t>(image_count, 1)), 1);
+}
+
+std::vector<ImageData> LoadImages(const Context& context)
+{
+    std::vector<ImageData> images(context.input_files.size());
+    const int image_jobs = JobsPerImage(context, images.size());
+
+    const auto load_image = [&](size_t index) {
+        images[index] = LoadImage(context.input_files[index], context, image_jobs);
+    };
+
+    ParallelFor(context.input_files.size(), context.jobs, load_image);
+
+    return images;
+}
+
+// Every input is decoded at most once and then scaled to each of the scale contexts from the source, the
+// result is indexed [scale][input].
+std::vector<std::vector<ImageData>> LoadImageScales(const std::vector<Context>& scale_contexts)
+{
+    const Context& context = scale_contexts.front();
+    const size_t image_count = context.input_files.size();
+    const int image_jobs = JobsPerImage(context, image_count);
+
+    std::vector<std::vector<ImageData>> scale_images(scale_contexts.size(), std::vector<ImageData>(image_count));
+
+    const auto load_image = [&](size_t index) {
+        const std::string& file = context.input_files[index];
+
+        std::vector<unsigned char> file_bytes;
+        if(!context.cache_dir.empty())
+            file_bytes = ReadFileBytes(file);
+
+        ImageData source;
+        for(size_t scale_index = 0; scale_index < scale_contexts.size(); ++scale_index)
+        {
+            const Context& scale_context = scale_contexts[scale_index];
+            ImageData& image = scale_images[scale_index][index];
+
+            uint64_t key = 0;
+            std::string cache_file;
+            if(!context.cache_dir.empty())
+            {
+                key = ImageCacheKey(file_bytes, scale_context);
+                cache_file = ImageCacheFile(context.cache_dir, key);
+                if(ReadCachedImage(cache_file, key, image))
+                    continue;
+            }
+
+            if(!source.data)
+                source = DecodeImage(file, context.cache_dir.empty() ? nullptr : &file_bytes);
+
+            image = source;
+            ProcessImage(image, scale_context, image_jobs);
+
+            if(!context.cache_dir.empty())
+                WriteCachedImage(cache_file, key, image);
+        }
+    };
+
+    ParallelFor(image_count, context.jobs, load_image);
+
+    return scale_images;
+}
+
+// Reads only the image headers, this gives the final image sizes of an untrimmed bake without decoding any pixels.
+std::vector<ImageSize> ProbeImages(const std::vector<std::string>& image_files, int scale_percentage, int jobs)
+{
+    std::vector<ImageSize> sizes(image_files.size());
+
+    const auto probe_image = [&](size_t index) {
+        const std::string& file = image_files[index];
+        ImageSize& size = sizes[index];
+
+        int color_components;
+        if(!stbi_info(file.c_str(), &size.width, &size.height, &color_components))
+            throw std::runtime_error(stbi_failure_reason() + std::string(" '") + file + "'");
+
+        if(scale_percentage != 100)
+        {
+            size.width = ScaledSize(size.width, scale_percentage);
+            size.height = ScaledSize(size.height, scale_percentage);
+        }
+    };
+
+    ParallelFor(image_files.size(), jobs, probe_image);
+
+    return sizes;
+}
+
+std::vector<ImageSize> ImageSizes(const std::vector<ImageData>& images)
+{
+    std::vector<ImageSize> sizes;
+    sizes.reserve(images.size());
+
+    for(const ImageData& image : images)
+        sizes.push_back({ image.width, image.height });
+
+    return sizes;
+}
+
+std::vector<FrameInfo> UniqueFrames(size_t count)
+{
+    std::vector<FrameInfo> frames(count);
+    for(size_t index = 0; index < count; ++index)
+        frames[index].image_index = index;
+
+    return frames;
+}
+
+void SetFrameSources(std::vector<FrameInfo>& frames, const std::vector<ImageData>& images)
+{
+    for(size_t index = 0; index < frames.size(); ++index)
+    {
+        const ImageData& image = images[index];
+        FrameInfo& frame = frames[index];
+        frame.source_width = image.source_width;
+        frame.source_height = image.source_height;
+        frame.offset_x = image.offset_x;
+        frame.offset_y = image.offset_y;
+    }
+}
+
+// Untrimmed images are their own source.
+void SetFrameSources(std::vector<FrameInfo>& frames, const std::vector<ImageSize>& sizes)
+{
+    for(size_t index = 0; index < frames.size(); ++index)
+    {
+        frames[index].source_width = sizes[index].width;
+        frames[index].source_height = sizes[index].height;
+    }
+}
+
+bool IsAlias(const std::vector<FrameInfo>& frames, size_t index)
+{
+    return frames[index].image_index != index;
+}
+
+// Compares 'second' to 'first' mirrored according to the flip flags.
+bool IsSameImage(const ImageData& first, const ImageData& second, bool flip_x, bool flip_y)
+{
+    if(first.width != second.width || first.height != second.height)
+        return false;
+
+    const size_t bytes_per_row = size_t(first.width) * 4;
+
+    for(int row = 0; row < second.height; ++row)
+    {
+        const int first_row = flip_y ? (first.height - 1 - row) : row;
+        const unsigned char* first_pixels = ImageRow(first, first_row);
+        const unsigned char* second_pixels = ImageRow(second, row);
+
+        if(!flip_x)
+        {
+            if(std::memcmp(first_pixels, second_pixels, bytes_per_row) != 0)
+                return false;
+
+            continue;
+        }
+
+        for(int column = 0; column < second.width; ++column)
+        {
+            if(std::memcmp(first_pixels + (first.width - 1 - column) * 4, second_pixels + column * 4, 4) != 0)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Hashes the image row by row as if it was mirrored according to the flip flags.
+uint64_t HashImage(const ImageData& image, bool flip_x, bool flip_y)
+{
+    const int32_t dimensions[] = { image.width, image.height };
+    const size_t bytes_per_row = size_t(image.width) * 4;
+
+    uint64_t hash = HashBytes(dimensions, sizeof(dimensions));
+    std::vector<unsigned char> flipped_row(flip_x ? bytes_per_row : 0);
+
+    for(int row = 0; row < image.height; ++row)
+    {
+        const unsigned char* row_pixels = ImageRow(image, flip_y ? (image.height - 1 - row) : row);
+
+        if(flip_x)
+        {
+            for(int column = 0; column < image.width; ++column)
+                std::memcpy(flipped_row.data() + column * 4, row_pixels + (image.width - 1 - column) * 4, 4);
+
+            row_pixels = flipped_row.data();
+        }
+
+        hash = HashBytes(row_pixels, bytes_per_row, hash);
+    }
+
+    return hash;
+}
+
+// Finds images with identical pixels, every duplicate becomes an alias of the first one. With 'include_flips'
+// an image that is a mirrored or 180° rotated copy of an earlier one becomes an alias with the flip flags set.
+// The images are hashed in parallel and only images with the same hash are compared in full.
+std::vector<FrameInfo> FindDuplicateImages(const std::vector<ImageData>& images, bool include_flips, int jobs)
+{
+    struct Orientation
+    {
+        bool flip_x;
+        bool flip_y;
+    };
+
+    constexpr Orientation orientations[] = { { false, false }, { true, false }, { false, true }, { true, true } };
+    const size_t orientation_count = include_flips ? std::size(orientations) : 1;
+
+    std::vector<uint64_t> hashes(images.size() * orientation_count);
+    const auto hash_image = [&](size_t index) {
+        for(size_t orientation = 0; orientation < orientation_count; ++orientation)
+        {
+            const Orientation& flip = orientations[orientation];
+            hashes[index * orientation_count + orientation] = HashImage(images[index], flip.flip_x, flip.flip_y);
+        }
+    };
+    ParallelFor(images.size(), jobs, hash_image);
+
+    std::vector<FrameInfo> frames = UniqueFrames(images.size());
+    std::unordered_multimap<uint64_t, size_t> unique_images;
+
+    for(size_t index = 0; index < images.size(); ++index)
+    {
+        for(size_t orientation = 0; orientation < orientation_count && !IsAlias(frames, index); ++orientation)
+        {
+            const Orientation& flip = orientations[orientation];
+            const auto candidates = unique_images.equal_range(hashes[index * orientation_count + orientation]);
+
+            for(auto it = candidates.first; it != candidates.second; ++it)
+            {
+                if(IsSameImage(images[it->second], images[index], flip.flip_x, flip.flip_y))
+                {
+                    frames[index].image_index = it->second;
+                    frames[index].flip_x = flip.flip_x;
+                    frames[index].flip_y = flip.flip_y;
+                    break;
+                }
+            }
+        }
+
+        if(!IsAlias(frames, index))
+            unique_images.emplace(hashes[index * orientation_count], index);
+    }
+
+    return frames;
+}
+
+// Scaling can make duplicates differ by a rounding, mirrored ones in particular. Only keeps the aliases that
+// are duplicates at every scale.
+void KeepCommonAliases(std::vector<FrameInfo>& frames, const std::vector<std::vector<ImageData>>& scale_images)
+{
+    for(size_t index = 0; index < frames.size(); ++index)
+    {
+        if(!IsAlias(frames, index))
+            continue;
+
+        const FrameInfo& frame = frames[index];
+        for(const std::vector<ImageData>& images : scale_images)
+        {
+            if(!IsSameImage(images[frame.image_index], images[index], frame.flip_x, frame.flip_y))
+            {
+                frames[index].image_index = index;
+                frames[index].flip_x = false;
+                frames[index].flip_y = false;
+                break;
+            }
+        }
+    }
+}
+
+void ApplyFrameAliases(std::vector<stbrp_rect>& rects, const std::vector<FrameInfo>& frames)
+{
+    for(size_t index = 0; index < frames.size(); ++index)
+    {
+        if(IsAlias(frames, index))
+        {
+            rects[index] = rects[frames[index].image_index];
+            rects[index].id = index;
+        }
+    }
+}
+
+struct FreeRect
+{
+    int x;
+    int y;
+    int w;
+    int h;
+};
+
+bool Contains(const FreeRect& outer, const FreeRect& inner)
+{
+    return inner.x >= outer.x && inner.y >= outer.y &&
+        inner.x + inner.w <= outer.x + outer.w && inner.y + inner.h <= outer.y + outer.h;
+}
+
+bool Intersects(const FreeRect& first, const FreeRect& second)
+{
+    return first.x < second.x + second.w && second.x < first.x + first.w &&
+        first.y < second.y + second.h && second.y < first.y + first.h;
+}
+
+// The free space is kept as a list of maximal free rectangles, a region is free if any of them contains it.
+bool IsFree(const std::vector<FreeRect>& free_rects, const FreeRect& region)
+{
+    const auto contains_region = [&region](const FreeRect& free_rect) {
+        return Contains(free_rect, region);
+    };
+    return std::any_of(free_rects.begin(), free_rects.end(), contains_region);
+}
+
+// Used rects bucketed in a uniform grid of cells, so the contact point heuristic only has to look at the
+// rects around a position instead of all of them.
+struct UsedRectGrid
+{
+    int width = 0;
+    int height = 0;
+    int cell_size = 1;
+    int columns = 0;
+    int rows = 0;
+    std::vector<std::vector<int>> cells;
+    std::vector<FreeRect> rects;
+    std::vector<unsigned int> visited;
+    unsigned int visit_stamp = 0;
+};
+
+UsedRectGrid MakeUsedRectGrid(int width, int height, int cell_size)
+{
+    UsedRectGrid grid;
+    grid.width = width;
+    grid.height = height;
+    grid.cell_size = std::max(cell_size, 1);
+    grid.columns = (width + grid.cell_size - 1) / grid.cell_size;
+    grid.rows = (height + grid.cell_size - 1) / grid.cell_size;
+    grid.cells.resize(size_t(grid.columns) * grid.rows);
+    return grid;
+}
+
+template <typename Function>
+void ForEachGridCell(const UsedRectGrid& grid, int x, int y, int w, int h, Function&& function)
+{
+    const int first_column = std::max(x / grid.cell_size, 0);
+    const int first_row = std::max(y / grid.cell_size, 0);
+    const int last_column = std::min((x + w - 1) / grid.cell_size, grid.columns - 1);
+    const int last_row = std::min((y + h - 1) / grid.cell_size, grid.rows - 1);
+
+    for(int row = first_row; row <= last_row; ++row)
+    {
+        for(int column = first_column; column <= last_column; ++column)
+            function(size_t(row) * grid.columns + column);
+    }
+}
+
+void AddUsedRect(UsedRectGrid& grid, const FreeRect& used)
+{
+    const int rect_index = grid.rects.size();
+    grid.rects.push_back(used);
+    grid.visited.push_back(0);
+    ForEachGridCell(grid, used.x, used.y, used.w, used.h, [&](size_t cell) {
+        grid.cells[cell].push_back(rect_index);
+    });
+}
+
+// The length of the rect's edges that touch the bin edges or an already used rect.
+int ContactLength(UsedRectGrid& grid, const FreeRect& rect)
+{
+    const auto overlap = [](int first_start, int first_end, int second_start, int second_end) {
+        return std::max(std::min(first_end, second_end) - std::max(first_start, second_start), 0);
+    };
+
+    int contact = 0;
+    if(rect.x == 0 || rect.x + rect.w == grid.width)
+        contact += rect.h;
+    if(rect.y == 0 || rect.y + rect.h == grid.height)
+        contact += rect.w;
+
+    ++grid.visit_stamp;
+    ForEachGridCell(grid, rect.x - 1, rect.y - 1, rect.w + 2, rect.h + 2, [&](size_t cell) {
+        for(int rect_index : grid.cells[cell])
+        {
+            if(grid.visited[rect_index] == grid.visit_stamp)
+                continue;
+            grid.visited[rect_index] = grid.visit_stamp;
+
+            const FreeRect& used = grid.rects[rect_index];
+            if(used.x == rect.x + rect.w || used.x + used.w == rect.x)
+                contact += overlap(rect.y, rect.y + rect.h, used.y, used.y + used.h);
+            if(used.y == rect.y + rect.h || used.y + used.h == rect.y)
+                contact += overlap(rect.x, rect.x + rect.w, used.x, used.x + used.w);
+        }
+    });
+
+    return contact;
+}
+
+// Places the rect in the top left corner of the free rectangle that scores best with the heuristic, lowest
+// score first and the first rectangle on ties. Returns false if there's no room. Only the contact point
+// heuristic needs the used rects.
+bool FindFreePosition(const std::vector<FreeRect>& free_rects, int width, int height, MaxRectsHeuristic heuristic,
+    UsedRectGrid* used_rects, int& x, int& y)
+{
+    // The free area of big rects doesn't fit an int.
+    constexpr int64_t no_score = std::numeric_limits<int64_t>::max();
+    std::pair<int64_t, int64_t> best_score = { no_score, no_score };
+
+    for(const FreeRect& free_rect : free_rects)
+    {
+        if(free_rect.w < width || free_rect.h < height)
+            continue;
+
+        const int leftover_x = free_rect.w - width;
+        const int leftover_y = free_rect.h - height;
+        const int short_side = std::min(leftover_x, leftover_y);
+        const int long_side = std::max(leftover_x, leftover_y);
+
+        std::pair<int64_t, int64_t> score;
+        switch(heuristic)
+        {
+        case MaxRectsHeuristic::BestAreaFit:
+            score = { int64_t(free_rect.w) * free_rect.h - int64_t(width) * height, short_side };
+            break;
+        case MaxRectsHeuristic::BottomLeft:
+            score = { free_rect.y + height, free_rect.x };
+            break;
+        case MaxRectsHeuristic::ContactPoint:
+            score = { -ContactLength(*used_rects, { free_rect.x, free_rect.y, width, height }), short_side };
+            break;
+        default:
+            score = { short_side, long_side };
+            break;
+        }
+
+        if(score < best_score)
+        {
+            best_score = score;
+            x = free_rect.x;
+            y = free_rect.y;
+        }
+    }
+
+    return best_score.first != no_score;
+}
+
+// Splits every free rectangle that overlaps the used region into the maximal rectangles around it.
+void OccupyRegion(std::vector<FreeRect>& free_rects, const FreeRect& used)
+{
+    std::vector<FreeRect> new_free_rects;
+
+    // The bounds of the split rectangles, every new rectangle lies inside them.
+    int split_left = std::numeric_limits<int>::max();
+    int split_top = std::numeric_limits<int>::max();
+    int split_right = std::numeric_limits<int>::min();
+    int split_bottom = std::numeric_limits<int>::min();
+
+    for(size_t index = 0; index < free_rects.size();)
+    {
+        const FreeRect free_rect = free_rects[index];
+        if(!Intersects(free_rect, used))
+        {
+            ++index;
+            continue;
+        }
+
+        free_rects[index] = free_rects.back();
+        free_rects.pop_back();
+
+        split_left = std::min(split_left, free_rect.x);
+        split_top = std::min(split_top, free_rect.y);
+        split_right = std::max(split_right, free_rect.x + free_rect.w);
+        split_bottom = std::max(split_bottom, free_rect.y + free_rect.h);
+
+        if(used.x > free_rect.x)
+            new_free_rects.push_back({ free_rect.x, free_rect.y, used.x - free_rect.x, free_rect.h });
+        if(used.x + used.w < free_rect.x + free_rect.w)
+            new_free_rects.push_back({ used.x + used.w, free_rect.y, free_rect.x + free_rect.w - (used.x + used.w), free_rect.h });
+        if(used.y > free_rect.y)
+            new_free_rects.push_back({ free_rect.x, free_rect.y, free_rect.w, used.y - free_rect.y });
+        if(used.y + used.h < free_rect.y + free_rect.h)
+            new_free_rects.push_back({ free_rect.x, used.y + used.h, free_rect.w, free_rect.y + free_rect.h - (used.y + used.h) });
+    }
+
+    if(new_free_rects.empty())
+        return;
+
+    // Drop the new rectangles that are contained in any other, the untouched ones are still maximal. Only the
+    // untouched rectangles overlapping the split bounds can contain a new one, so the pruning doesn't scan the
+    // whole list for every new rectangle.
+    const FreeRect split_bounds = { split_left, split_top, split_right - split_left, split_bottom - split_top };
+    std::vector<FreeRect> nearby_free_rects;
+    for(const FreeRect& free_rect : free_rects)
+    {
+        if(Intersects(free_rect, split_bounds))
+            nearby_free_rects.push_back(free_rect);
+    }
+
+    for(size_t index = 0; index < new_free_rects.size(); ++index)
+    {
+        const FreeRect& candidate = new_free_rects[index];
+
+        bool is_contained = IsFree(nearby_free_rects, candidate);
+        for(size_t other = 0; other < new_free_rects.size() && !is_contained; ++other)
+        {
+            const FreeRect& other_rect = new_free_rects[other];
+            const bool is_same = std::memcmp(&candidate, &other_rect, sizeof(FreeRect)) == 0;
+            is_contained = (other != index) && Contains(other_rect, candidate) && (!is_same || other < index);
+        }
+
+        if(!is_contained)
+            free_rects.push_back(candidate);
+    }
+}
+
+// Largest first by the order's main measure, then by a second one, then in input order.
+void SortPackRects(std::vector<stbrp_rect>& pack_rects, PackOrder order)
+{
+    const auto sort_key = [order](const stbrp_rect& rect) {
+        const int64_t width = rect.w;
+        const int64_t height = rect.h;
+        switch(order)
+        {
+        case PackOrder::Width:
+            return std::make_pair(width, height);
+        case PackOrder::Area:
+            return std::make_pair(width * height, std::max(width, height));
+        case PackOrder::MaxSide:
+            return std::make_pair(std::max(width, height), std::min(width, height));
+        case PackOrder::Perimeter:
+            return std::make_pair(width + height, std::max(width, height));
+        default:
+            return std::make_pair(height, width);
+        }
+    };
+
+    const auto is_larger = [&](const stbrp_rect& first, const stbrp_rect& second) {
+        return sort_key(first) > sort_key(second);
+    };
+    std::stable_sort(pack_rects.begin(), pack_rects.end(), is_larger);
+}
+
+// Packs the rects in place by keeping the free space as maximal free rectangles, returns false if they don't
+// all fit. The rects that don't fit are skipped and left with 'was_packed' cleared, like stbrp_pack_rects does.
+// The default order is by height like the skyline packer.
+bool PackMaxRects(std::vector<stbrp_rect>& pack_rects, int width, int height, MaxRectsHeuristic heuristic, PackOrder order)
+{
+    SortPackRects(pack_rects, order == PackOrder::Default ? PackOrder::Height : order);
+
+    std::vector<FreeRect> free_rects = { { 0, 0, width, height } };
+
+    // Cells about the size of an average rect keep the contact lookups down to a few neighbours.
+    UsedRectGrid used_rects;
+    if(heuristic == MaxRectsHeuristic::ContactPoint)
+    {
+        int64_t total_area = 0;
+        for(const stbrp_rect& rect : pack_rects)
+            total_area += int64_t(rect.w) * rect.h;
+
+        const int average_side = std::sqrt(double(total_area) / std::max<size_t>(pack_rects.size(), 1));
+        used_rects = MakeUsedRectGrid(width, height, std::max(average_side, 16));
+    }
+
+    bool all_packed = true;
+
+    for(stbrp_rect& rect : pack_rects)
+    {
+        rect.x = 0;
+        rect.y = 0;
+        rect.was_packed = 1;
+
+        if(rect.w == 0 || rect.h == 0)
+            continue;
+
+        if(!FindFreePosition(free_rects, rect.w, rect.h, heuristic, &used_rects, rect.x, rect.y))
+        {
+            rect.was_packed = 0;
+            all_packed = false;
+            continue;
+        }
+
+        const FreeRect used = { rect.x, rect.y, rect.w, rect.h };
+        OccupyRegion(free_rects, used);
+        if(heuristic == MaxRectsHeuristic::ContactPoint)
+            AddUsedRect(used_rects, used);
+    }
+
+    return all_packed;
+}
+
+// Packs the rects in place, returns false if they don't all fit. The ones that fit are still packed and marked
+// with 'was_packed'. With the skyline packer orders other than the default pack the rects one at a time in that
+// order, since stbrp_pack_rects always sorts by height itself.
+bool PackRects(std::vector<stbrp_rect>& pack_rects, int width, int height, Packer packer, int heuristic, PackOrder order)
+{
+    if(packer == Packer::MaxRects)
+        return PackMaxRects(pack_rects, width, height, MaxRectsHeuristic(heuristic), order);
+
+    stbrp_context pack_context;
+
+    std::vector<stbrp_node> nodes;
+    nodes.resize(width);
+
+    stbrp_init_target(&pack_context, width, height, nodes.data(), nodes.size());
+    stbrp_setup_heuristic(&pack_context, heuristic);
+
+    if(order == PackOrder::Default)
+        return stbrp_pack_rects(&pack_context, pack_rects.data(), pack_rects.size()) != 0;
+
+    SortPackRects(pack_rects, order);
+
+    bool all_packed = true;
+
+    for(stbrp_rect& rect : pack_rects)
+    {
+        if(!stbrp_pack_rects(&pack_context, &rect, 1))
+            all_packed = false;
+    }
+
+    return all_packed;
+}
+
+// Packs with every heuristic and order and keeps the one that packs the most area, and of those the one with the
+// smallest bounding box of the packed rects. Every candidate is packed on its own and the ties go to the first one
+// in the list, so the result doesn't depend on the number of jobs or their timing. The default order is skipped,
+// both packers sort by height for it, which is the same as the height order.
+bool SearchPackRects(std::vector<stbrp_rect>& pack_rects, int width, int height, const Context& context)
+{
+    const std::vector<std::string>& heuristic_names = PackHeuristicNames(context.packer);
+    const size_t heuristic_count = heuristic_names.size();
+    constexpr size_t order_count = std::size(pack_order_names) - 1;
+    const auto candidate_order = [](size_t index) {
+        return PackOrder(1 + index % order_count);
+    };
+
+    std::vector<std::vector<stbrp_rect>> candidates(heuristic_count * order_count, pack_rects);
+    std::vector<char> all_packed(candidates.size(), false);
+
+    // The negated packed area and the used area, lower is better.
+    std::vector<std::pair<int64_t, int64_t>> scores(candidates.size());
+
+    const auto pack_candidate = [&](size_t index) {
+        std::vector<stbrp_rect>& candidate = candidates[index];
+        all_packed[index] = PackRects(candidate, width, height, context.packer, int(index / order_count), candidate_order(index));
+
+        int64_t packed_area = 0;
+        int used_width = 0;
+        int used_height = 0;
+        for(const stbrp_rect& rect : candidate)
+        {
+            if(!rect.was_packed)
+                continue;
+
+            packed_area += int64_t(rect.w) * rect.h;
+            used_width = std::max(used_width, rect.x + rect.w);
+            used_height = std::max(used_height, rect.y + rect.h);
+        }
+        scores[index] = { -packed_area, int64_t(used_width) * used_height };
+    };
+    ParallelFor(candidates.size(), context.jobs, pack_candidate);
+
+    const size_t best = std::min_element(scores.begin(), scores.end()) - scores.begin();
+
+    std::printf("Packed with heuristic '%s' and order '%s'.\n",
+        heuristic_names[best / order_count].c_str(), pack_order_names[size_t(candidate_order(best))]);
+
+    pack_rects = std::move(candidates[best]);
+    return all_packed[best] != 0;
+}
+
+// A rect with its padding for every frame that shows its own image.
+std::vector<stbrp_rect> PaddedPackRects(const std::vector<ImageSize>& sizes, const std::vector<FrameInfo>& frames, int padding)
+{
+    std::vector<stbrp_rect> pack_rects;
+    pack_rects.reserve(sizes.size());
+
+    for(size_t index = 0; index < sizes.size(); ++index)
+    {
+        if(IsAlias(frames, index))
+            continue;
+
+        const ImageSize& image_size = sizes[index];
+
+        stbrp_rect rect;
+        rect.id = index;
+        rect.w = image_size.width + padding * 2;
+        rect.h = image_size.height + padding * 2;
+
+        pack_rects.push_back(rect);
+    }
+
+    return pack_rects;
+}
+
+// Packs every frame that shows its own image, aliases get the rect of the image they show.
+std::vector<stbrp_rect> PackImages(
+    const std::vector<ImageSize>& sizes, const std::vector<FrameInfo>& frames, int width, int height, int padding, const Context& context)
+{
+    std::vector<stbrp_rect> pack_rects = PaddedPackRects(sizes, frames, padding);
+
+    const bool success = context.pack_search ?
+        SearchPackRects(pack_rects, width, height, context) :
+        PackRects(pack_rects, width, height, context.packer, context.pack_heuristic, context.pack_order);
+    if(!success)
+        throw std::runtime_error("Unable to pack all images, consider a bigger output image.");
+
+    for(stbrp_rect& rect : pack_rects)
+    {
+        rect.x += padding;
+        rect.y += padding;
+        rect.w -= (padding * 2);
+        rect.h -= (padding * 2);
+    }
+
+    std::vector<stbrp_rect> rects(sizes.size());
+    for(const stbrp_rect& rect : pack_rects)
+        rects[rect.id] = rect;
+
+    ApplyFrameAliases(rects, frames);
+    return rects;
+}
+
+// Frames are aligned to blocks of this many pixels, so no texel of the last mip level covers two frames.
+int MipBlockSize(const Context& context)
+{
+    return 1 << context.mip_levels;
+}
+
+// The size of every frame and its padding in whole blocks.
+std::vector<ImageSize> MipBlockSizes(const std::vector<ImageSize>& sizes, const Context& context)
+{
+    const int block = MipBlockSize(context);
+
+    std::vector<ImageSize> block_sizes(sizes.size());
+    for(size_t index = 0; index < sizes.size(); ++index)
+    {
+        block_sizes[index].width = (sizes[index].width + context.padding * 2 + block - 1) / block;
+        block_sizes[index].height = (sizes[index].height + context.padding * 2 + block - 1) / block;
+    }
+
+    return block_sizes;
+}
+
+// The rects the frames are packed as and the size of their units in pixels. With -mip_levels every frame and its
+// padding gets a cell of whole blocks packed on the grid of blocks, otherwise the units are pixels.
+struct GridRects
+{
+    int unit;
+    std::vector<stbrp_rect> rects;
+};
+
+GridRects GridPackRects(const std::vector<ImageSize>& sizes, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    if(context.mip_levels > 0)
+        return { MipBlockSize(context), PaddedPackRects(MipBlockSizes(sizes, context), frames, 0) };
+
+    return { 1, PaddedPackRects(sizes, frames, context.padding) };
+}
+
+// The output image size in units of the grid, which it has to be a whole number of.
+ImageSize GridPackSize(const Context& context, int unit)
+{
+    if(context.output_width % unit != 0 || context.output_height % unit != 0)
+    {
+        throw std::runtime_error("The output image size must be a multiple of " + std::to_string(unit) + " for " +
+            std::to_string(context.mip_levels) + " mip levels.");
+    }
+
+    return { context.output_width / unit, context.output_height / unit };
+}
+
+// The frame rects in pixels from the rects packed on the grid, aliases get the rect of the image they show.
+std::vector<stbrp_rect> PlaceGridRects(const std::vector<stbrp_rect>& pack_rects, int unit,
+    const std::vector<ImageSize>& sizes, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    std::vector<stbrp_rect> rects(sizes.size());
+    for(const stbrp_rect& pack_rect : pack_rects)
+    {
+        stbrp_rect& rect = rects[pack_rect.id];
+        rect = pack_rect;
+        rect.x = pack_rect.x * unit + context.padding;
+        rect.y = pack_rect.y * unit + context.padding;
+        rect.w = sizes[pack_rect.id].width;
+        rect.h = sizes[pack_rect.id].height;
+    }
+
+    ApplyFrameAliases(rects, frames);
+    return rects;
+}
+
+// The cell of whole blocks around a frame packed by PackLayout with -mip_levels.
+stbrp_rect MipCell(const stbrp_rect& rect, const Context& context)
+{
+    const int block = MipBlockSize(context);
+
+    stbrp_rect cell = rect;
+    cell.x = rect.x - context.padding;
+    cell.y = rect.y - context.padding;
+    cell.w = (rect.w + context.padding * 2 + block - 1) / block * block;
+    cell.h = (rect.h + context.padding * 2 + block - 1) / block * block;
+    return cell;
+}
+
+std::vector<stbrp_rect> PackLayout(const std::vector<ImageSize>& sizes, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    GridRects grid = GridPackRects(sizes, frames, context);
+    const ImageSize& pack_size = GridPackSize(context, grid.unit);
+
+    const bool success = context.pack_search ?
+        SearchPackRects(grid.rects, pack_size.width, pack_size.height, context) :
+        PackRects(grid.rects, pack_size.width, pack_size.height, context.packer, context.pack_heuristic, context.pack_order);
+    if(!success)
+        throw std::runtime_error("Unable to pack all images, consider a bigger output image.");
+
+    return PlaceGridRects(grid.rects, grid.unit, sizes, frames, context);
+}
+
+// The sizes -auto_size can pick for a side in ascending order, multiples of the mip block size with -mip_levels.
+std::vector<int> AutoSizeCandidates(const Context& context)
+{
+    int multiple = context.size_multiple;
+    if(context.mip_levels > 0)
+        multiple = std::lcm(multiple, MipBlockSize(context));
+
+    std::vector<int> candidates;
+    if(context.auto_size_pow2)
+    {
+        for(int size = 1; size <= context.max_size; size *= 2)
+        {
+            if(size % multiple == 0)
+                candidates.push_back(size);
+        }
+    }
+    else
+    {
+        for(int size = multiple; size <= context.max_size; size += multiple)
+            candidates.push_back(size);
+    }
+
+    return candidates;
+}
+
+// Finds a small output image the frames fit in within the -auto_size constraints. Whether the frames fit isn't
+// monotonic in the width or height with either packer, so this is a heuristic search and not a proof of the
+// smallest size. Every candidate width is packed with a little more than the total rect area first and with more
+// until it fits, then with the height that layout used, which fits the same layout with the skyline packer, and a
+// few bisection steps look for a smaller height. Only sizes that were packed successfully are returned. The widths
+// between half and twice the side of a square of the total rect area are searched in parallel, and of the results
+// within a few percent of the smallest area the squarest one wins. A width is skipped when even the total rect
+// area makes it larger than that, which can't change the result, so it doesn't depend on the number of jobs.
+ImageSize FindAutoSize(const std::vector<ImageSize>& sizes, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    constexpr double area_tolerance = 0.05;
+    constexpr size_t max_width_candidates = 12;
+    constexpr int height_refine_steps = 3;
+
+    const GridRects& grid = GridPackRects(sizes, frames, context);
+    const int unit = grid.unit;
+    const std::vector<stbrp_rect>& pack_rects = grid.rects;
+
+    int64_t total_area = 0;
+    int min_width = 1;
+    int min_height = 1;
+    for(const stbrp_rect& rect : pack_rects)
+    {
+        total_area += int64_t(rect.w * unit) * (rect.h * unit);
+        min_width = std::max(min_width, rect.w * unit);
+        min_height = std::max(min_height, rect.h * unit);
+    }
+
+    const std::vector<int>& candidates = AutoSizeCandidates(context);
+    const auto first_candidate = [&candidates](int64_t minimum) -> size_t {
+        return std::lower_bound(candidates.begin(), candidates.end(), minimum) - candidates.begin();
+    };
+
+    const std::string& no_fit_error =
+        "Unable to pack all images within 'max_size' " + std::to_string(context.max_size) + ", consider a bigger one.";
+    if(candidates.empty())
+        throw std::runtime_error(no_fit_error);
+
+    // Packs with the heuristic and order of the context and returns the size the packed rects use, 0 x 0 if they
+    // don't fit. Even with -pack_search the final layout only gets better.
+    const auto pack_used_size = [&](int width, int height) {
+        std::vector<stbrp_rect> candidate_rects = pack_rects;
+        ImageSize used_size = { 0, 0 };
+        if(!PackRects(candidate_rects, width / unit, height / unit, context.packer, context.pack_heuristic, context.pack_order))
+            return used_size;
+
+        for(const stbrp_rect& rect : candidate_rects)
+        {
+            used_size.width = std::max(used_size.width, (rect.x + rect.w) * unit);
+            used_size.height = std::max(used_size.height, (rect.y + rect.h) * unit);
+        }
+        return used_size;
+    };
+
+    if(context.auto_size_square)
+    {
+        const int max_side = candidates.back();
+        const ImageSize& used_size = pack_used_size(max_side, max_side);
+        if(used_size.width == 0)
+            throw std::runtime_error(no_fit_error);
+
+        const int64_t min_side = std::max<int64_t>({ min_width, min_height, int64_t(std::ceil(std::sqrt(double(total_area)))) });
+        size_t low = first_candidate(min_side);
+        size_t fitting = candidates.size() - 1;
+        size_t probe = first_candidate(std::max(used_size.width, used_size.height));
+        while(low < fitting)
+        {
+            if(probe >= fitting)
+                probe = (low + fitting) / 2;
+
+            if(pack_used_size(candidates[probe], candidates[probe]).width != 0)
+                fitting = probe;
+            else
+                low = probe + 1;
+            probe = fitting;
+        }
+
+        return { candidates[fitting], candidates[fitting] };
+    }
+
+    // The smallest height that fit 'width', from the candidate 'first_height' on, 0 if it doesn't fit.
+    const auto search_height = [&](int width, size_t first_height) {
+        size_t low = first_height;
+        size_t fitting = candidates.size();
+        ImageSize used_size = { 0, 0 };
+
+        // A little more than the total rect area first, and twice the extra area every time it doesn't fit.
+        for(double slack = 0.02; fitting == candidates.size() && low < candidates.size(); slack *= 2.0)
+        {
+            const size_t probe = std::max(low, first_candidate(int64_t(std::ceil(total_area * (1.0 + slack) / width))));
+            const size_t clamped_probe = std::min(probe, candidates.size() - 1);
+
+            used_size = pack_used_size(width, candidates[clamped_probe]);
+            if(used_size.width != 0)
+                fitting = clamped_probe;
+            else
+                low = clamped_probe + 1;
+        }
+
+        if(fitting == candidates.size())
+            return 0;
+
+        // The height the layout used fits the same layout with the skyline packer, below it bisect.
+        size_t probe = first_candidate(used_size.height);
+        for(int step = 0; step < height_refine_steps && low < fitting; ++step)
+        {
+            if(probe >= fitting || probe < low)
+                probe = (low + fitting) / 2;
+
+            used_size = pack_used_size(width, candidates[probe]);
+            if(used_size.width != 0)
+            {
+                fitting = probe;
+                probe = first_candidate(used_size.height);
+            }
+            else
+            {
+                low = probe + 1;
+                probe = fitting;
+            }
+        }
+        return candidates[fitting];
+    };
+
+    constexpr int64_t no_area = std::numeric_limits<int64_t>::max();
+    const int64_t max_side = candidates.back();
+
+    // Up to 'max_width_candidates' widths spread evenly over the candidates from 'first' to 'last'.
+    const auto search_widths = [&](size_t first, size_t last) {
+        std::vector<ImageSize> results;
+        if(first > last || first >= candidates.size())
+            return results;
+
+        const size_t width_count = last - first + 1;
+        const size_t result_count = std::min(width_count, max_width_candidates);
+        for(size_t index = 0; index < result_count; ++index)
+        {
+            const size_t candidate = first + (result_count > 1 ? index * (width_count - 1) / (result_count - 1) : 0);
+            results.push_back({ candidates[candidate], 0 });
+        }
+
+        std::atomic<int64_t> best_area = no_area;
+        const auto search_width = [&](size_t index) {
+            const int width = results[index].width;
+            const size_t first_height = first_candidate(std::max<int64_t>(min_height, (total_area + width - 1) / width));
+            if(first_height == candidates.size() || width * double(candidates[first_height]) > best_area * (1.0 + area_tolerance))
+                return;
+
+            results[index].height = search_height(width, first_height);
+            if(results[index].height == 0)
+                return;
+
+            const int64_t area = int64_t(width) * results[index].height;
+            int64_t current_best = best_area;
+            while(area < current_best && !best_area.compare_exchange_weak(current_best, area))
+            { }
+        };
+        ParallelFor(results.size(), context.jobs, search_width);
+
+        return results;
+    };
+
+    const double square_side = std::sqrt(double(total_area));
+    const int64_t min_fitting_width = std::max<int64_t>(min_width, (total_area + max_side - 1) / max_side);
+    const size_t first_width = first_candidate(std::max<int64_t>(min_fitting_width, int64_t(square_side / 2)));
+    const size_t last_width = std::min(std::max(first_width, first_candidate(int64_t(std::ceil(square_side * 2)))), candidates.size() - 1);
+
+    const auto has_fit = [](const std::vector<ImageSize>& results) {
+        return std::any_of(results.begin(), results.end(), [](const ImageSize& size) { return size.height > 0; });
+    };
+
+    // Very uneven rects might only fit at other widths.
+    std::vector<ImageSize> results = search_widths(first_width, last_width);
+    if(!has_fit(results))
+        results = search_widths(first_candidate(min_fitting_width), candidates.size() - 1);
+    if(!has_fit(results))
+        throw std::runtime_error(no_fit_error);
+
+    int64_t smallest_area = no_area;
+    for(const ImageSize& size : results)
+    {
+        if(size.height > 0)
+            smallest_area = std::min(smallest_area, int64_t(size.width) * size.height);
+    }
+
+    const auto squareness = [](const ImageSize& size) {
+        return std::make_pair(std::max(size.width, size.height), int64_t(size.width) * size.height);
+    };
+
+    ImageSize best_size = { 0, 0 };
+    for(const ImageSize& size : results)
+    {
+        const bool is_eligible = size.height > 0 && int64_t(size.width) * size.height <= smallest_area * (1.0 + area_tolerance);
+        if(is_eligible && (best_size.height == 0 || squareness(size) < squareness(best_size)))
+            best_size = size;
+    }
+
+    return best_size;
+}
+
+// Packs the frames into the smallest output image allowed by the -auto_size constraints and sets its size in the
+// context. The image is then cropped to the smallest allowed size around the packed frames, so only the area that
+// is used gets allocated and encoded.
+std::vector<stbrp_rect> PackAutoSized(const std::vector<ImageSize>& sizes, const std::vector<FrameInfo>& frames, Context& context)
+{
+    const ImageSize& size = FindAutoSize(sizes, frames, context);
+    context.output_width = size.width;
+    context.output_height = size.height;
+
+    const std::vector<stbrp_rect>& rects = PackLayout(sizes, frames, context);
+
+    int used_width = 1;
+    int used_height = 1;
+    for(const stbrp_rect& rect : rects)
+    {
+        const stbrp_rect& cell = (context.mip_levels > 0) ? MipCell(rect, context) :
+            stbrp_rect{ rect.id, rect.w + context.padding * 2, rect.h + context.padding * 2, rect.x - context.padding, rect.y - context.padding, 1 };
+        used_width = std::max(used_width, cell.x + cell.w);
+        used_height = std::max(used_height, cell.y + cell.h);
+    }
+
+    if(context.auto_size_square)
+        used_width = used_height = std::max(used_width, used_height);
+
+    const std::vector<int>& candidates = AutoSizeCandidates(context);
+    context.output_width = *std::lower_bound(candidates.begin(), candidates.end(), used_width);
+    context.output_height = *std::lower_bound(candidates.begin(), candidates.end(), used_height);
+
+    std::printf("Auto sized the output image to %dx%d.\n", context.output_width, context.output_height);
+    return rects;
+}
+
+// Packs the frames into as many output images as they need. Every page is packed with as many of the remaining
+// frames as fit, largest first, and the rest spill to the next page. The page of every frame is set in 'frames'.
+std::vector<stbrp_rect> PackPages(const std::vector<ImageSize>& sizes, std::vector<FrameInfo>& frames, const Context& context)
+{
+    GridRects grid = GridPackRects(sizes, frames, context);
+    const ImageSize& pack_size = GridPackSize(context, grid.unit);
+
+    std::vector<stbrp_rect> remaining_rects = std::move(grid.rects);
+    std::vector<stbrp_rect> packed_rects;
+
+    for(int page = 0; !remaining_rects.empty(); ++page)
+    {
+        std::vector<stbrp_rect> page_rects = remaining_rects;
+        if(context.pack_search)
+            SearchPackRects(page_rects, pack_size.width, pack_size.height, context);
+        else
+            PackRects(page_rects, pack_size.width, pack_size.height, context.packer, context.pack_heuristic, context.pack_order);
+
+        remaining_rects.clear();
+        for(const stbrp_rect& rect : page_rects)
+        {
+            if(rect.was_packed)
+            {
+                packed_rects.push_back(rect);
+                frames[rect.id].page = page;
+            }
+            else
+            {
+                remaining_rects.push_back(rect);
+            }
+        }
+
+        // Nothing fits on an empty page, so no number of pages will do.
+        if(remaining_rects.size() == page_rects.size())
+        {
+            throw std::runtime_error(
+                "Unable to pack '" + context.input_files[remaining_rects.front().id] + "', it is bigger than the output image.");
+        }
+    }
+
+    const std::vector<stbrp_rect>& rects = PlaceGridRects(packed_rects, grid.unit, sizes, frames, context);
+    for(size_t index = 0; index < frames.size(); ++index)
+        frames[index].page = frames[frames[index].image_index].page;
+
+    return rects;
+}
+
+// Packs all scales with the same layout. The layout is in units of the greatest common divisor of the scales,
+// which is a whole number of pixels at every scale, and every frame gets as many units as it needs at any
+// scale. The rects at each scale are the units scaled up, so the frames start at the same uvs at every scale.
+std::vector<std::vector<stbrp_rect>> PackImagesProportional(
+    const std::vector<std::vector<ImageData>>& scale_images, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    const int unit_percentage = LayoutUnitPercentage(context.scales);
+
+    std::vector<ImageSize> unit_sizes(frames.size(), ImageSize{ 0, 0 });
+    for(size_t scale_index = 0; scale_index < context.scales.size(); ++scale_index)
+    {
+        const int unit_pixels = context.scales[scale_index] / unit_percentage;
+        for(size_t index = 0; index < frames.size(); ++index)
+        {
+            const ImageData& image = scale_images[scale_index][index];
+            unit_sizes[index].width = std::max(unit_sizes[index].width, (image.width + unit_pixels - 1) / unit_pixels);
+            unit_sizes[index].height = std::max(unit_sizes[index].height, (image.height + unit_pixels - 1) / unit_pixels);
+        }
+    }
+
+    const int unit_width = context.output_width * unit_percentage / 100;
+    const int unit_height = context.output_height * unit_percentage / 100;
+    const int unit_padding = (context.padding * unit_percentage + 99) / 100;
+    const std::vector<stbrp_rect>& unit_rects = PackImages(unit_sizes, frames, unit_width, unit_height, unit_padding, context);
+
+    std::vector<std::vector<stbrp_rect>> scale_rects(context.scales.size());
+    for(size_t scale_index = 0; scale_index < context.scales.size(); ++scale_index)
+    {
+        const int unit_pixels = context.scales[scale_index] / unit_percentage;
+        std::vector<stbrp_rect>& rects = scale_rects[scale_index];
+
+        rects = unit_rects;
+        for(stbrp_rect& rect : rects)
+        {
+            const ImageData& image = scale_images[scale_index][rect.id];
+            rect.x *= unit_pixels;
+            rect.y *= unit_pixels;
+            rect.w = image.width;
+            rect.h = image.height;
+        }
+    }
+
+    return scale_rects;
+}
+
+struct PreviousLayout
+{
+    std::vector<std::string> filenames;
+    std::vector<stbrp_rect> rects;
+
+    // Index into the frames of the previous layout for every image kept in place, -1 otherwise.
+    std::vector<int> kept_frames;
+};
+
+// Reads the frames of a json file written by WriteGenericJson, a missing file is an empty layout.
+// Throws if the file is not valid json or is missing one of the frame fields.
+PreviousLayout ReadPreviousLayout(const std::string& layout_file)
+{
+    PreviousLayout layout;
+
+    std::ifstream input_stream(layout_file);
+    if(!input_stream.good())
+        return layout;
+
+    try
+    {
+        const nlohmann::json& json = nlohmann::json::parse(input_stream);
+        for(const nlohmann::json& frame_object : json.at("frames"))
+        {
+            const nlohmann::json& frame = frame_object.at("frame");
+
+            stbrp_rect rect = {};
+            rect.id = layout.rects.size();
+            rect.x = frame.at("x");
+            rect.y = frame.at("y");
+            rect.w = frame.at("w");
+            rect.h = frame.at("h");
+
+            layout.filenames.push_back(frame_object.at("filename"));
+            layout.rects.push_back(rect);
+        }
+    }
+    catch(const nlohmann::json::exception& error)
+    {
+        throw std::runtime_error("Invalid previous layout '" + layout_file + "', " + error.what());
+    }
+
+    return layout;
+}
+
+// Keeps every image at its previous position when it still fits there, and places only new or moved
+// images in the free space around them, reserving 'layout_slack' pixels so they can grow in later bakes.
+// Falls back to packing from scratch if the remaining images don't fit.
+std::vector<stbrp_rect> PackImagesIncremental(
+    const std::vector<ImageSize>& sizes, const std::vector<FrameInfo>& frames, PreviousLayout& previous, const Context& context)
+{
+    const int padding = context.padding;
+
+    std::vector<FreeRect> free_rects = { { 0, 0, context.output_width, context.output_height } };
+    std::vector<stbrp_rect> rects(sizes.size());
+    std::vector<int>& kept_frames = previous.kept_frames;
+    kept_frames.assign(sizes.size(), -1);
+
+    std::unordered_multimap<std::string, int> previous_frames;
+    for(size_t index = 0; index < previous.filenames.size(); ++index)
+        previous_frames.emplace(previous.filenames[index], index);
+
+    const auto padded_region = [padding](int x, int y, const ImageSize& size) {
+        return FreeRect { x - padding, y - padding, size.width + padding * 2, size.height + padding * 2 };
+    };
+
+    // Images that shrunk or kept their size go first, then the ones that grew might still fit in place.
+    for(const bool grown_pass : { false, true })
+    {
+        for(size_t index = 0; index < sizes.size(); ++index)
+        {
+            if(IsAlias(frames, index))
+                continue;
+
+            const auto frame_range = previous_frames.equal_range(context.input_files[index]);
+            for(auto it = frame_range.first; it != frame_range.second; ++it)
+            {
+                const stbrp_rect& previous_rect = previous.rects[it->second];
+                const ImageSize& size = sizes[index];
+                const bool has_grown = size.width > previous_rect.w || size.height > previous_rect.h;
+                if(has_grown != grown_pass)
+                    continue;
+
+                const FreeRect& region = padded_region(previous_rect.x, previous_rect.y, size);
+                if(!IsFree(free_rects, region))
+                    continue;
+
+                OccupyRegion(free_rects, region);
+                kept_frames[index] = it->second;
+                rects[index] = { int(index), size.width, size.height, previous_rect.x, previous_rect.y, 1 };
+                previous_frames.erase(it);
+                break;
+            }
+        }
+    }
+
+    std::vector<size_t> placement_order;
+    for(size_t index = 0; index < sizes.size(); ++index)
+    {
+        if(kept_frames[index] < 0 && !IsAlias(frames, index))
+            placement_order.push_back(index);
+    }
+
+    const auto by_area = [&sizes](size_t first, size_t second) {
+        return sizes[first].width * sizes[first].height > sizes[second].width * sizes[second].height;
+    };
+    std::stable_sort(placement_order.begin(), placement_order.end(), by_area);
+
+    for(size_t index : placement_order)
+    {
+        const ImageSize& size = sizes[index];
+        ImageSize slot = { size.width + context.layout_slack, size.height + context.layout_slack };
+
+        int x, y;
+        bool found = FindFreePosition(
+            free_rects, slot.width + padding * 2, slot.height + padding * 2, MaxRectsHeuristic::BestShortSideFit, nullptr, x, y);
+        if(!found)
+        {
+            slot = size;
+            found = FindFreePosition(
+                free_rects, slot.width + padding * 2, slot.height + padding * 2, MaxRectsHeuristic::BestShortSideFit, nullptr, x, y);
+        }
+
+        if(!found)
+        {
+            std::printf("Unable to keep the previous layout, packing all images.\n");
+            kept_frames.assign(sizes.size(), -1);
+            return PackImages(sizes, frames, context.output_width, context.output_height, padding, context);
+        }
+
+        OccupyRegion(free_rects, padded_region(x + padding, y + padding, slot));
+        rects[index] = { int(index), size.width, size.height, x + padding, y + padding, 1 };
+    }
+
+    ApplyFrameAliases(rects, frames);
+    return rects;
+}
+
+// round(value / 255) for any product of two bytes.
+int DivideBy255(int value)
+{
+    value += 128;
+    return (value + (value >> 8)) >> 8;
+}
+
+void PremultiplyPixelsScalar(const unsigned char* source, unsigned char* destination, int pixel_count)
+{
+    for(int index = 0; index < pixel_count * 4; index += 4)
+    {
+        const int alpha = source[index + 3];
+        destination[index + 0] = DivideBy255(source[index + 0] * alpha);
+        destination[index + 1] = DivideBy255(source[index + 1] * alpha);
+        destination[index + 2] = DivideBy255(source[index + 2] * alpha);
+        destination[index + 3] = alpha;
+    }
+}
+
+#ifdef SPRITEBAKER_SSE2
+
+// Same rounding as the scalar version, two pixels per 16 bit multiply with the alpha lane multiplied by 255.
+void PremultiplyPixelsSSE2(const unsigned char* source, unsigned char* destination, int pixel_count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(128);
+    const __m128i color_mask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i alpha_multiplier = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+
+    const auto premultiply = [&](__m128i pixels) {
+        __m128i alpha = _mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+        alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+        const __m128i multiplier = _mm_or_si128(_mm_and_si128(alpha, color_mask), alpha_multiplier);
+
+        __m128i product = _mm_add_epi16(_mm_mullo_epi16(pixels, multiplier), rounding);
+        product = _mm_add_epi16(product, _mm_srli_epi16(product, 8));
+        return _mm_srli_epi16(product, 8);
+    };
+
+    int index = 0;
+    for(; index + 4 <= pixel_count; index += 4)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + index * 4));
+        const __m128i low = premultiply(_mm_unpacklo_epi8(pixels, zero));
+        const __m128i high = premultiply(_mm_unpackhi_epi8(pixels, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + index * 4), _mm_packus_epi16(low, high));
+    }
+
+    PremultiplyPixelsScalar(source + index * 4, destination + index * 4, pixel_count - index);
+}
+
+#endif
+
+void PremultiplyPixels(const unsigned char* source, unsigned char* destination, int pixel_count)
+{
+#ifdef SPRITEBAKER_SSE2
+    PremultiplyPixelsSSE2(source, destination, pixel_count);
+#else
+    PremultiplyPixelsScalar(source, destination, pixel_count);
+#endif
+}
+
+std::array<unsigned char, 4> BackgroundPixel(const Context& context)
+{
+    std::array<unsigned char, 4> background = { context.background_r, context.background_g, context.background_b, context.background_a };
+    if(context.premultiply_alpha)
+        PremultiplyPixelsScalar(background.data(), background.data(), 1);
+
+    return background;
+}
+
+std::vector<unsigned char> CreateOutputImage(const Context& context)
+{
+    // RGBA
+    constexpr int color_components = 4;
+    const size_t image_size = size_t(context.output_width) * context.output_height * color_components;
+    std::vector<unsigned char> output_image_bytes(image_size, 0);
+
+    const std::array<unsigned char, 4>& background = BackgroundPixel(context);
+    for(size_t index = 0; index < output_image_bytes.size(); index += color_components)
+        std::memcpy(&output_image_bytes[index], background.data(), color_components);
+
+    return output_image_bytes;
+}
+
+// The images keep straight alpha up to here, with 'premultiply_alpha' they are premultiplied on the way
+// into the output image.
+void BlitImage(const ImageData& image, const stbrp_rect& rect, std::vector<unsigned char>& output_image_bytes, const Context& context)
+{
+    // RGBA
+    constexpr int color_components = 4;
+    const int output_width = context.output_width;
+    const size_t start_offset = rect.x + (size_t(rect.y) * output_width);
+    const size_t bytes_to_copy = size_t(image.width) * color_components;
+
+    for(int index = 0; index < image.height; ++index)
+    {
+        const size_t output_offset = (start_offset + (size_t(index) * output_width)) * color_components;
+        if(context.premultiply_alpha)
+            PremultiplyPixels(ImageRow(image, index), &output_image_bytes[output_offset], image.width);
+        else
+            std::memcpy(&output_image_bytes[output_offset], ImageRow(image, index), bytes_to_copy);
+    }
+}
+
+// Fills the cell around a frame with copies of its edge pixels, so filtering at the edge of the frame and
+// the smaller mip levels only ever see the frame's own colors.
+void ExtrudeFrameEdges(std::vector<unsigned char>& output_image_bytes, const stbrp_rect& rect, const stbrp_rect& cell, int output_width)
+{
+    if(rect.w == 0 || rect.h == 0)
+        return;
+
+    for(int y = cell.y; y < cell.y + cell.h; ++y)
+    {
+        const int source_y = std::clamp(y, rect.y, rect.y + rect.h - 1);
+        unsigned char* row = &output_image_bytes[size_t(y) * output_width * 4];
+        const unsigned char* source_row = &output_image_bytes[size_t(source_y) * output_width * 4];
+
+        for(int x = cell.x; x < cell.x + cell.w; ++x)
+        {
+            const bool is_frame_pixel = (y == source_y && x >= rect.x && x < rect.x + rect.w);
+            if(!is_frame_pixel)
+                std::memcpy(row + x * 4, source_row + std::clamp(x, rect.x, rect.x + rect.w - 1) * 4, 4);
+        }
+    }
+}
+
+// Every cell once, aliases share the cell of the frame they point to.
+std::vector<stbrp_rect> UniqueMipCells(const std::vector<stbrp_rect>& rects, const Context& context)
+{
+    std::vector<stbrp_rect> cells;
+    cells.reserve(rects.size());
+    for(const stbrp_rect& rect : rects)
+        cells.push_back(MipCell(rect, context));
+
+    const auto by_position = [](const stbrp_rect& first, const stbrp_rect& second) {
+        return first.y < second.y || (first.y == second.y && first.x < second.x);
+    };
+    const auto is_same_position = [](const stbrp_rect& first, const stbrp_rect& second) {
+        return first.x == second.x && first.y == second.y;
+    };
+    std::sort(cells.begin(), cells.end(), by_position);
+    cells.erase(std::unique(cells.begin(), cells.end(), is_same_position), cells.end());
+
+    return cells;
+}
+
+float SrgbToLinear(unsigned char value)
+{
+    static const std::array<float, 256> table = []() {
+        std::array<float, 256> values;
+        for(int index = 0; index < 256; ++index)
+        {
+            const float srgb = index / 255.0f;
+            values[index] = (srgb <= 0.04045f) ? srgb / 12.92f : std::pow((srgb + 0.055f) / 1.055f, 2.4f);
+        }
+        return values;
+    }();
+
+    return table[value];
+}
+
+unsigned char LinearToSrgb(float value)
+{
+    const float srgb = (value <= 0.0031308f) ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+    return (unsigned char)std::clamp(int(srgb * 255.0f + 0.5f), 0, 255);
+}
+
+// Halves a level, every texel is the average of a 2x2 block. Straight alpha colors are weighted by alpha, so
+// fully transparent texels don't pull the colors at the edges of the frames towards the background, while
+// premultiplied colors already are. With 'srgb' the colors are averaged in linear light.
+std::vector<unsigned char> DownsampleMipLevel(const std::vector<unsigned char>& level, int width, int height, const Context& context)
+{
+    const int half_width = width / 2;
+    const int half_height = height / 2;
+    std::vector<unsigned char> half_level(size_t(half_width) * half_height * 4);
+
+    const auto downsample_row = [&](size_t row) {
+        const unsigned char* top_row = &level[row * 2 * width * 4];
+        const unsigned char* bottom_row = top_row + size_t(width) * 4;
+        unsigned char* half_row = &half_level[row * half_width * 4];
+
+        for(int x = 0; x < half_width; ++x)
+        {
+            const unsigned char* texels[] = { top_row + x * 8, top_row + x * 8 + 4, bottom_row + x * 8, bottom_row + x * 8 + 4 };
+            const int alpha_sum = texels[0][3] + texels[1][3] + texels[2][3] + texels[3][3];
+            const bool is_weighted = (alpha_sum > 0 && !context.premultiply_alpha);
+
+            for(int component = 0; component < 3; ++component)
+            {
+                float sum = 0.0f;
+                for(const unsigned char* texel : texels)
+                {
+                    const float value = context.srgb ? SrgbToLinear(texel[component]) : texel[component];
+                    sum += is_weighted ? value * texel[3] : value;
+                }
+
+                const float average = sum / (is_weighted ? alpha_sum : 4);
+                half_row[x * 4 + component] = context.srgb ? LinearToSrgb(average) : (unsigned char)(average + 0.5f);
+            }
+
+            half_row[x * 4 + 3] = (alpha_sum + 2) / 4;
+        }
+    };
+    ParallelFor(half_height, context.jobs, downsample_row);
+
+    return half_level;
+}
+
+unsigned char ScaleAlpha(unsigned char alpha, float alpha_scale)
+{
+    return (unsigned char)std::min(int(alpha * alpha_scale + 0.5f), 255);
+}
+
+// Fraction of the texels in 'region' that pass the alpha test after scaling their alpha.
+float AlphaCoverage(const std::vector<unsigned char>& level, int width, const stbrp_rect& region, int reference, float alpha_scale)
+{
+    int passed = 0;
+    for(int y = region.y; y < region.y + region.h; ++y)
+    {
+        const unsigned char* row = &level[size_t(y) * width * 4];
+        for(int x = region.x; x < region.x + region.w; ++x)
+            passed += (ScaleAlpha(row[x * 4 + 3], alpha_scale) >= reference);
+    }
+
+    return float(passed) / std::max(region.w * region.h, 1);
+}
+
+// Scales the alpha of the region so the same fraction of texels passes the alpha test as at full resolution,
+// otherwise alpha tested sprites thin out and vanish in the smaller levels. Premultiplied colors are scaled along.
+// Regions that already have the coverage are kept, the search would lower the alpha of opaque ones to the reference.
+void PreserveAlphaCoverage(std::vector<unsigned char>& level, int width, const stbrp_rect& region, int reference, float coverage, bool premultiplied)
+{
+    if(AlphaCoverage(level, width, region, reference, 1.0f) == coverage)
+        return;
+
+    float lower_scale = 0.0f;
+    float upper_scale = 4.0f;
+    for(int iteration = 0; iteration < 12; ++iteration)
+    {
+        const float alpha_scale = (lower_scale + upper_scale) / 2.0f;
+        if(AlphaCoverage(level, width, region, reference, alpha_scale) < coverage)
+            lower_scale = alpha_scale;
+        else
+            upper_scale = alpha_scale;
+    }
+
+    for(int y = region.y; y < region.y + region.h; ++y)
+    {
+        unsigned char* row = &level[size_t(y) * width * 4];
+        for(int x = region.x; x < region.x + region.w; ++x)
+        {
+            unsigned char* texel = row + x * 4;
+            texel[3] = ScaleAlpha(texel[3], upper_scale);
+
+            if(premultiplied)
+            {
+                for(int component = 0; component < 3; ++component)
+                    texel[component] = std::min(ScaleAlpha(texel[component], upper_scale), texel[3]);
+            }
+        }
+    }
+}
+
+std::string MipChainFile(const Context& context)
+{
+    const size_t dot_pos = context.output_file.find_last_of(".");
+    return context.output_file.substr(0, dot_pos) + ".ktx";
+}
+
+// KTX 1.1 (https://registry.khronos.org/KTX/specs/1.0/ktxspec.v1.html) with uncompressed RGBA8 levels.
+void WriteMipChain(const std::vector<unsigned char>& output_image_bytes, const std::vector<stbrp_rect>& rects, const Context& context)
+{
+    const std::vector<stbrp_rect>& cells = UniqueMipCells(rects, context);
+
+    std::vector<float> cell_coverages(cells.size(), 0.0f);
+    if(context.mip_coverage_reference > 0)
+    {
+        const auto find_coverage = [&](size_t index) {
+            cell_coverages[index] =
+                AlphaCoverage(output_image_bytes, context.output_width, cells[index], context.mip_coverage_reference, 1.0f);
+        };
+        ParallelFor(cells.size(), context.jobs, find_coverage);
+    }
+
+    const uint32_t level_count = context.mip_levels + 1;
+    const uint32_t header[] = {
+        0x04030201, // endianness
+        0x1401,     // GL_UNSIGNED_BYTE
+        1,          // type size
+        0x1908,     // GL_RGBA
+        context.srgb ? 0x8C43u : 0x8058u, // GL_SRGB8_ALPHA8, the levels are sRGB encoded, or GL_RGBA8
+        0x1908,     // GL_RGBA
+        uint32_t(context.output_width),
+        uint32_t(context.output_height),
+        0,          // depth
+        0,          // array elements
+        1,          // faces
+        level_count,
+        0           // key value data
+    };
+    const unsigned char identifier[] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+    const std::string& mip_chain_filename = MipChainFile(context);
+    std::ofstream out_file(mip_chain_filename, std::ios::binary);
+    out_file.write(reinterpret_cast<const char*>(identifier), sizeof(identifier));
+    out_file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    // The levels are downsampled from the previous level before its alpha is adjusted.
+    std::vector<unsigned char> level = output_image_bytes;
+    int width = context.output_width;
+    int height = context.output_height;
+
+    for(uint32_t level_index = 0; level_index < level_count; ++level_index)
+    {
+        if(level_index > 0)
+        {
+            level = DownsampleMipLevel(level, width, height, context);
+            width /= 2;
+            height /= 2;
+        }
+
+        std::vector<unsigned char> adjusted_level;
+        if(context.mip_coverage_reference > 0 && level_index > 0)
+        {
+            adjusted_level = level;
+            const auto preserve_coverage = [&](size_t index) {
+                stbrp_rect region = cells[index];
+                region.x >>= level_index;
+                region.y >>= level_index;
+                region.w >>= level_index;
+                region.h >>= level_index;
+                PreserveAlphaCoverage(
+                    adjusted_level, width, region, context.mip_coverage_reference, cell_coverages[index], context.premultiply_alpha);
+            };
+            ParallelFor(cells.size(), context.jobs, preserve_coverage);
+        }
+
+        const std::vector<unsigned char>& written_level = adjusted_level.empty() ? level : adjusted_level;
+
+        // RGBA8 rows are always 4 byte aligned, no padding needed.
+        const uint32_t image_size = uint32_t(written_level.size());
+        out_file.write(reinterpret_cast<const char*>(&image_size), sizeof(image_size));
+        out_file.write(reinterpret_cast<const char*>(written_level.data()), written_level.size());
+    }
+
+    if(!out_file)
+        throw std::runtime_error("Unable to write to '" + mip_chain_filename + "'");
+}
+
+void SaveOutputImage(std::vector<unsigned char>& output_image_bytes, const std::vector<stbrp_rect>& rects, const Context& context)
+{
+    if(context.mip_levels > 0)
+    {
+        for(const stbrp_rect& rect : rects)
+            ExtrudeFrameEdges(output_image_bytes, rect, MipCell(rect, context), context.output_width);
+    }
+
+    constexpr int stride = 0;
+    const bool success =
+        stbi_write_png(context.output_file.c_str(), context.output_width, context.output_height, 4, output_image_bytes.data(), stride) != 0;
+    if(!success)
+        throw std::runtime_error("Unable to write output image");
+
+    if(context.mip_levels > 0)
+        WriteMipChain(output_image_bytes, rects, context);
+}
+
+void WriteImage(const std::vector<ImageData>& images, const std::vector<stbrp_rect>& rects, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    std::vector<unsigned char> output_image_bytes = CreateOutputImage(context);
+
+    for(const stbrp_rect& rect : rects)
+    {
+        if(!IsAlias(frames, rect.id))
+            BlitImage(images[rect.id], rect, output_image_bytes, context);
+    }
+
+    SaveOutputImage(output_image_bytes, rects, context);
+}
+
+// Decodes every image straight into its packed slot and frees it right away, so at most one image per
+// job is alive next to the output image. The packed rects are disjoint which makes the blits thread safe.
+void BakeImages(const std::vector<stbrp_rect>& rects, const Context& context)
+{
+    std::vector<unsigned char> output_image_bytes = CreateOutputImage(context);
+    const int image_jobs = JobsPerImage(context, rects.size());
+
+    const auto bake_image = [&](size_t index) {
+        const stbrp_rect& rect = rects[index];
+        const std::string& file = context.input_files[rect.id];
+
+        const ImageData& image = LoadImage(file, context, image_jobs);
+        if(image.width != rect.w || image.height != rect.h)
+            throw std::runtime_error("Image size differs from its header '" + file + "'");
+
+        BlitImage(image, rect, output_image_bytes, context);
+    };
+
+    ParallelFor(rects.size(), context.jobs, bake_image);
+
+    SaveOutputImage(output_image_bytes, rects, context);
+}
+
+// 'atlas.png' is 'atlas_0.png', 'atlas_1.png', ... with 'multi_page'.
+std::string PageOutputFile(const std::string& output_file, int page)
+{
+    const size_t dot_pos = output_file.find_last_of(".");
+    return output_file.substr(0, dot_pos) + "_" + std::to_string(page) + output_file.substr(dot_pos);
+}
+
+// The settings of every output image, just the context itself without 'multi_page'. The pages are written
+// at the same time, so they split the jobs between them.
+std::vector<Context> PageContexts(const std::vector<FrameInfo>& frames, const Context& context)
+{
+    if(!context.multi_page)
+        return { context };
+
+    int page_count = 1;
+    for(const FrameInfo& frame : frames)
+        page_count = std::max(page_count, frame.page + 1);
+
+    std::vector<Context> page_contexts(page_count, context);
+    for(int page = 0; page < page_count; ++page)
+    {
+        page_contexts[page].output_file = PageOutputFile(context.output_file, page);
+        page_contexts[page].jobs = JobsPerImage(context, page_count);
+    }
+
+    return page_contexts;
+}
+
+// The output image or mip chain file of every page.
+std::vector<std::string> PageFiles(const std::vector<Context>& page_contexts, const std::function<std::string(const Context&)>& page_file)
+{
+    std::vector<std::string> files;
+    for(const Context& page_context : page_contexts)
+        files.push_back(page_file(page_context));
+
+    return files;
+}
+
+// Composites and encodes every page concurrently. Without decoded images each page decodes its own inputs.
+void WritePages(const std::vector<ImageData>* images, const std::vector<stbrp_rect>& rects, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    const std::vector<Context>& page_contexts = PageContexts(frames, context);
+
+    std::vector<std::vector<stbrp_rect>> page_rects(page_contexts.size());
+    for(const stbrp_rect& rect : rects)
+        page_rects[frames[rect.id].page].push_back(rect);
+
+    const auto write_page = [&](size_t page) {
+        if(images)
+            WriteImage(*images, page_rects[page], frames, page_contexts[page]);
+        else
+            BakeImages(page_rects[page], page_contexts[page]);
+    };
+    ParallelFor(page_contexts.size(), context.jobs, write_page);
+}
+
+// Rewrites only the parts of the existing output image that changed since the previous layout. Frames
+// that moved or went away are cleared to the background and an image kept in place is only written if
+// its pixels differ. Returns false if there's no usable output image to patch.
+bool PatchOutputImage(
+    const std::vector<ImageData>* images, const std::vector<stbrp_rect>& rects, const std::vector<FrameInfo>& frames, const PreviousLayout& previous, const Context& context)
+{
+    int width, height, color_components;
+    stbi_uc* data = stbi_load(context.output_file.c_str(), &width, &height, &color_components, STBI_rgb_alpha);
+    if(!data)
+        return false;
+
+    const PixelBuffer previous_image = AdoptPixels(data);
+    if(width != context.output_width || height != context.output_height)
+        return false;
+
+    std::vector<unsigned char> output_image_bytes(previous_image.get(), previous_image.get() + size_t(width) * height * 4);
+
+    const auto is_unmoved = [&](size_t index) {
+        const int frame_index = previous.kept_frames[index];
+        if(frame_index < 0)
+            return false;
+
+        const stbrp_rect& rect = rects[index];
+        const stbrp_rect& previous_rect = previous.rects[frame_index];
+        return rect.x == previous_rect.x && rect.y == previous_rect.y && rect.w == previous_rect.w && rect.h == previous_rect.h;
+    };
+
+    // Previous aliases share the rect of the frame they showed, so a rect stays if any frame in it is unmoved.
+    const auto rect_key = [](const stbrp_rect& rect) {
+        return std::array<int, 4>{ rect.x, rect.y, rect.w, rect.h };
+    };
+
+    std::vector<std::array<int, 4>> unmoved_rects;
+    for(size_t index = 0; index < rects.size(); ++index)
+    {
+        if(is_unmoved(index))
+            unmoved_rects.push_back(rect_key(rects[index]));
+    }
+    std::sort(unmoved_rects.begin(), unmoved_rects.end());
+
+    const std::array<unsigned char, 4>& background = BackgroundPixel(context);
+
+    for(const stbrp_rect& rect : previous.rects)
+    {
+        if(std::binary_search(unmoved_rects.begin(), unmoved_rects.end(), rect_key(rect)))
+            continue;
+
+        const int x_end = std::min(rect.x + rect.w, width);
+        const int y_end = std::min(rect.y + rect.h, height);
+
+        for(int y = std::max(rect.y, 0); y < y_end; ++y)
+        {
+            for(int x = std::max(rect.x, 0); x < x_end; ++x)
+                std::memcpy(&output_image_bytes[(size_t(y) * width + x) * 4], background.data(), 4);
+        }
+    }
+
+    const int image_jobs = JobsPerImage(context, rects.size());
+
+    const auto patch_image = [&](size_t index) {
+        if(IsAlias(frames, index))
+            return;
+
+        const stbrp_rect& rect = rects[index];
+        const std::string& file = context.input_files[rect.id];
+
+        const ImageData& image = images ? (*images)[index] : LoadImage(file, context, image_jobs);
+        if(image.width != rect.w || image.height != rect.h)
+            throw std::runtime_error("Image size differs from its header '" + file + "'");
+
+        if(is_unmoved(index))
+        {
+            const size_t bytes_per_row = size_t(image.width) * 4;
+
+            // The output holds the rows as BlitImage wrote them, premultiplied with 'premultiply_alpha'.
+            std::vector<unsigned char> premultiplied_row(context.premultiply_alpha ? bytes_per_row : 0);
+
+            bool is_equal = true;
+            for(int row = 0; row < image.height && is_equal; ++row)
+            {
+                const unsigned char* existing = &output_image_bytes[((size_t(rect.y) + row) * width + rect.x) * 4];
+                const unsigned char* source_row = ImageRow(image, row);
+                if(context.premultiply_alpha)
+                {
+                    PremultiplyPixels(source_row, premultiplied_row.data(), image.width);
+                    source_row = premultiplied_row.data();
+                }
+
+                is_equal = std::memcmp(existing, source_row, bytes_per_row) == 0;
+            }
+
+            if(is_equal)
+                return;
+        }
+
+        BlitImage(image, rect, output_image_bytes, context);
+    };
+
+    ParallelFor(rects.size(), context.jobs, patch_image);
+
+    SaveOutputImage(output_image_bytes, rects, context);
+    return true;
+}
+
+struct RectId_Suffix
+{
+    size_t rect_id;
+    std::string animation_name;
+    int image_index;
+};
+
+struct SpriteMetadata
+{
+    std::string source_folder;
+    std::vector<RectId_Suffix> rect_and_suffixes;
+};
+
+constexpr uint32_t hit_mask_version = 1;
+
+struct HitMaskHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t frame_count;
+    uint32_t row_bits;
+};
+
+struct HitMaskEntry
+{
+    uint64_t offset;
+    uint32_t width;
+    uint32_t height;
+};
+
+// The structs are written as they are, so their layout is the file format. The sizes keep the masks after them
+// 8 byte aligned.
+static_assert(sizeof(HitMaskHeader) == 16);
+static_assert(offsetof(HitMaskHeader, magic) == 0);
+static_assert(offsetof(HitMaskHeader, version) == 4);
+static_assert(offsetof(HitMaskHeader, frame_count) == 8);
+static_assert(offsetof(HitMaskHeader, row_bits) == 12);
+static_assert(sizeof(HitMaskEntry) == 16);
+static_assert(offsetof(HitMaskEntry, offset) == 0);
+static_assert(offsetof(HitMaskEntry, width) == 8);
+static_assert(offsetof(HitMaskEntry, height) == 12);
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    #error "The hit mask file is little endian and is written in native byte order."
+#endif
+
+std::string HitMaskFile(const Context& context)
+{
+    const size_t dot_pos = context.output_file.find_last_of(".");
+    return context.output_file.substr(0, dot_pos) + ".hitmask";
+}
+
+// The file is a header, an entry per input image with the byte offset and size of its mask, and then the masks
+// themselves, so it can be mapped and read in place. Everything is little endian and the masks are 8 byte aligned.
+// Aliases that aren't flipped share the mask of the frame they point to.
+std::string WriteHitMasks(const std::vector<ImageData>& images, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    std::vector<std::vector<uint64_t>> masks(images.size());
+    const auto build_mask = [&](size_t index) {
+        const FrameInfo& frame = frames[index];
+        if(!IsAlias(frames, index) || frame.flip_x || frame.flip_y)
+            masks[index] = BuildHitMask(images[index], context.hit_mask_threshold);
+    };
+    ParallelFor(images.size(), context.jobs, build_mask);
+
+    HitMaskHeader header = {};
+    std::memcpy(header.magic, "SBHM", 4);
+    header.version = hit_mask_version;
+    header.frame_count = uint32_t(images.size());
+    header.row_bits = 64;
+
+    std::vector<HitMaskEntry> entries(images.size());
+    uint64_t offset = sizeof(HitMaskHeader) + sizeof(HitMaskEntry) * entries.size();
 
     for(size_t index = 0; index < images.size(); ++index)
     {
-        const ImageData& image_data = images[index];
-
-        stbrp_rect rect;
-        rect.id = index;
-        rect.w = image_data.width + padding * 2;
-        rect.h = image_data.height + padding * 2;
+        const FrameInfo& frame = frames[index];
+        entries[index].width = images[index].width;
+        entries[index].height = images[index].height;
 
-        pack_rects.push_back(rect);
+        if(masks[index].empty() && IsAlias(frames, index) && !frame.flip_x && !frame.flip_y)
+        {
+            entries[index].offset = entries[frame.image_index].offset;
+        }
+        else
+        {
+            entries[index].offset = offset;
+            offset += masks[index].size() * sizeof(uint64_t);
+        }
     }
 
-    stbrp_context pack_context;
-    
-    std::vector<stbrp_node> nodes;
-    nodes.resize(width);
+    const std::string& hit_mask_filename = HitMaskFile(context);
 
-    stbrp_init_target(&pack_context, width, height, nodes.data(), nodes.size());
-    const bool success = stbrp_pack_rects(&pack_context, pack_rects.data(), pack_rects.size()) != 0;
-    if(!success)
-        throw std::runtime_error("Unable to pack all images, consider a bigger output image.");
+    std::ofstream out_file(hit_mask_filename, std::ios::binary);
+    out_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out_file.write(reinterpret_cast<const char*>(entries.data()), sizeof(HitMaskEntry) * entries.size());
+    for(const std::vector<uint64_t>& mask : masks)
+        out_file.write(reinterpret_cast<const char*>(mask.data()), mask.size() * sizeof(uint64_t));
 
-    for(stbrp_rect& rect : pack_rects)
-    {
-        rect.x += padding;
-        rect.y += padding;
-        rect.w -= (padding * 2);
-        rect.h -= (padding * 2);
-    }
+    if(!out_file)
+        throw std::runtime_error("Unable to write to '" + hit_mask_filename + "'");
 
-    return pack_rects;
+    return hit_mask_filename;
 }
 
-void WriteImage(const std::vector<ImageData>& images, const std::vector<stbrp_rect>& rects, const Context& context)
+// Vertices are in pixels relative to the untrimmed image, the uvs are normalized output image coordinates of the
+// frame's rect and take the flip flags into account.
+nlohmann::json PolygonMeshToJson(const FrameInfo& frame_info, const stbrp_rect& rect, const Context& context)
 {
-    const int width = context.output_width;
-    const int height = context.output_height;
-
-    // RGBA
-    constexpr int color_components = 4;
-    const int image_size = width * height * color_components;
-    std::vector<unsigned char> output_image_bytes(image_size, 0);
-
-    for(size_t index = 0; index < output_image_bytes.size(); ++index)
-    {
-        output_image_bytes[index] = context.background_r;
-        output_image_bytes[++index] = context.background_g;
-        output_image_bytes[++index] = context.background_b;
-        output_image_bytes[++index] = context.background_a;
-    }
+    nlohmann::json vertices = nlohmann::json::array();
+    nlohmann::json uvs = nlohmann::json::array();
 
-    for(const stbrp_rect& rect : rects)
+    for(const MeshVertex& vertex : frame_info.mesh_vertices)
     {
-        const int start_offset = rect.x + (rect.y * width);
-        const ImageData& image = images[rect.id];
-
-        for(int index = 0; index < image.height; ++index)
-        {
-            const int output_offset = (start_offset + (index * width)) * color_components;
-            const int image_offset = index * image.width * color_components;
-            const int bytes_to_copy = image.width * color_components;
+        vertices.push_back({ vertex.x + frame_info.offset_x, vertex.y + frame_info.offset_y });
 
-            std::memcpy(&output_image_bytes[output_offset], &image.data[image_offset], bytes_to_copy);
-        }
+        const float frame_x = frame_info.flip_x ? (rect.w - vertex.x) : vertex.x;
+        const float frame_y = frame_info.flip_y ? (rect.h - vertex.y) : vertex.y;
+        uvs.push_back({ (rect.x + frame_x) / context.output_width, (rect.y + frame_y) / context.output_height });
     }
 
-    constexpr int stride = 0;
-    const bool success = stbi_write_png(context.output_file.c_str(), width, height, 4, output_image_bytes.data(), stride) != 0;
-    if(!success)
-        throw std::runtime_error("Unable to write output image");
+    nlohmann::json mesh;
+    mesh["vertices"] = vertices;
+    mesh["uvs"] = uvs;
+    mesh["indices"] = frame_info.mesh_indices;
+    return mesh;
 }
 
-void WriteSpriteFiles(const std::vector<stbrp_rect>& rects, const Context& context)
+// In pixels relative to the untrimmed image, like 'sprite_source_size'.
+nlohmann::json OpaqueRectToJson(const FrameInfo& frame_info)
 {
-    struct RectId_Suffix
-    {
-        size_t rect_id;
-        std::string animation_name;
-        int image_index;
-    };
+    const AlphaBounds& bounds = frame_info.opaque_rect;
 
-    struct SpriteMetadata
-    {
-        std::string source_folder;
-        std::vector<RectId_Suffix> rect_and_suffixes;
-    };
+    nlohmann::json opaque_rect;
+    opaque_rect["x"] = bounds.left + frame_info.offset_x;
+    opaque_rect["y"] = bounds.top + frame_info.offset_y;
+    opaque_rect["w"] = bounds.right - bounds.left;
+    opaque_rect["h"] = bounds.bottom - bounds.top;
+    return opaque_rect;
+}
 
+std::string SpriteOutputFolder(const Context& context)
+{
     std::string output_folder;
 
     const size_t slash_pos = context.output_file.find_last_of('/');
     if(slash_pos != std::string::npos)
         output_folder = context.output_file.substr(0, slash_pos +1);
 
-    const std::string real_output_folder = (context.sprite_folder.empty() ? output_folder : context.sprite_folder);
+    return (context.sprite_folder.empty() ? output_folder : context.sprite_folder);
+}
 
+// Groups the input files by sprite name, the key is the sprite name.
+std::unordered_map<std::string, SpriteMetadata> GatherSpriteMetadata(const Context& context)
+{
     // (.+\/)?(\S*?)(\[\S*\])?([\d]+)?\.
     const std::regex filename_matcher("(.+\\/)?(\\S*?)(\\[\\S*\\])?([\\d]+)?\\.");
 
@@ -400,6 +3776,15 @@ void WriteSpriteFiles(const std::vector<stbrp_rect>& rects, const Context& conte
         metadata.rect_and_suffixes.push_back(id_suffix);
     }
 
+    return sprite_files;
+}
+
+std::vector<std::string> WriteSpriteFiles(const std::vector<stbrp_rect>& rects, const std::vector<FrameInfo>& frame_infos, const Context& context)
+{
+    const std::string real_output_folder = SpriteOutputFolder(context);
+    const std::unordered_map<std::string, SpriteMetadata>& sprite_files = GatherSpriteMetadata(context);
+    const std::vector<Context>& page_contexts = PageContexts(frame_infos, context);
+
     nlohmann::json all_sprite_files;
 
     for(const auto& file_metadata : sprite_files)
@@ -441,11 +3826,31 @@ void WriteSpriteFiles(const std::vector<stbrp_rect>& rects, const Context& conte
             object["w"] = rect.w;
             object["h"] = rect.h;
 
+            if(context.deduplicate_flips)
+            {
+                object["flip_x"] = frame_infos[frame_index.rect_id].flip_x;
+                object["flip_y"] = frame_infos[frame_index.rect_id].flip_y;
+            }
+
+            if(context.polygon_mesh_vertices > 0)
+                object["mesh"] = PolygonMeshToJson(frame_infos[frame_index.rect_id], rect, context);
+
+            if(context.opaque_rects)
+                object["opaque_rect"] = OpaqueRectToJson(frame_infos[frame_index.rect_id]);
+
+            if(context.hit_mask_threshold > 0)
+                object["hit_mask"] = frame_index.rect_id;
+
+            if(context.multi_page)
+                object["page"] = frame_infos[frame_index.rect_id].page;
+
             frames.push_back(object);
 
+            // How far the center of the trimmed frame is from the center of the untrimmed image, in pixels.
+            const FrameInfo& frame_info = frame_infos[frame_index.rect_id];
             nlohmann::json offset_object;
-            offset_object["x"] = 0.0f;
-            offset_object["y"] = 0.0f;
+            offset_object["x"] = frame_info.offset_x + rect.w / 2.0f - frame_info.source_width / 2.0f;
+            offset_object["y"] = frame_info.offset_y + rect.h / 2.0f - frame_info.source_height / 2.0f;
             frames_offsets.push_back(offset_object);
 
             if(!frame_index.animation_name.empty())
@@ -485,8 +3890,9 @@ void WriteSpriteFiles(const std::vector<stbrp_rect>& rects, const Context& conte
                 if(anim_it != parsed_sprite_file.end() && anim_it->is_array())
                     animations = *anim_it;
                 
+                // Trimmed frames get their offsets from the trimming, otherwise keep the ones in the file.
                 const auto frames_offsets_it = parsed_sprite_file.find("frames_offsets");
-                if(frames_offsets_it != parsed_sprite_file.end() && frames_offsets_it->is_array())
+                if(frames_offsets_it != parsed_sprite_file.end() && frames_offsets_it->is_array() && !context.trim_images)
                     frames_offsets = *frames_offsets_it;
             }
         }
@@ -508,13 +3914,32 @@ void WriteSpriteFiles(const std::vector<stbrp_rect>& rects, const Context& conte
         texture_size["h"] = context.output_height;
 
         nlohmann::json json;
-        json["texture"] = context.output_file;
+        json["texture"] = page_contexts.front().output_file;
         json["source_folder"] = sprite_metadata.source_folder;
         json["texture_size"] = texture_size;
         json["frames"] = frames;
         json["frames_offsets"] = frames_offsets;
         json["animations"] = animations;
 
+        if(context.hit_mask_threshold > 0)
+            json["hit_masks"] = HitMaskFile(context);
+
+        if(context.premultiply_alpha)
+            json["premultiplied_alpha"] = true;
+
+        if(context.mip_levels > 0)
+        {
+            json["mip_chain"] = MipChainFile(page_contexts.front());
+            json["mip_levels"] = context.mip_levels;
+        }
+
+        if(context.multi_page)
+        {
+            json["textures"] = PageFiles(page_contexts, [](const Context& page_context) { return page_context.output_file; });
+            if(context.mip_levels > 0)
+                json["mip_chains"] = PageFiles(page_contexts, MipChainFile);
+        }
+
         out_file << std::setw(4) << json << std::endl;
         all_sprite_files.push_back(sprite_file);
     }
@@ -524,11 +3949,22 @@ void WriteSpriteFiles(const std::vector<stbrp_rect>& rects, const Context& conte
     nlohmann::json all_sprite_files_json;
     all_sprite_files_json["all_sprites"] = all_sprite_files;
 
-    std::ofstream out_all_file(real_output_folder + "all_sprite_files.json");
+    const std::string& all_sprite_files_file = real_output_folder + "all_sprite_files.json";
+    std::ofstream out_all_file(all_sprite_files_file);
     out_all_file << std::setw(4) << all_sprite_files_json << std::endl;
+
+    std::vector<std::string> written_files = all_sprite_files.get<std::vector<std::string>>();
+    written_files.push_back(all_sprite_files_file);
+    return written_files;
+}
+
+std::string GenericJsonFile(const Context& context)
+{
+    const size_t dot_pos = context.output_file.find_last_of(".");
+    return context.output_file.substr(0, dot_pos) + ".json";
 }
 
-void WriteGenericJson(const std::vector<stbrp_rect>& rects, const Context& context)
+std::string WriteGenericJson(const std::vector<stbrp_rect>& rects, const std::vector<FrameInfo>& frame_infos, const Context& context)
 {
     nlohmann::json frames;
 
@@ -544,13 +3980,15 @@ void WriteGenericJson(const std::vector<stbrp_rect>& rects, const Context& conte
         pivot["x"] = 0.5f;
         pivot["y"] = 0.5f;
 
+        const FrameInfo& frame_info = frame_infos[rect.id];
+
         nlohmann::json source_size;
-        source_size["w"] = rect.w;
-        source_size["h"] = rect.h;
+        source_size["w"] = frame_info.source_width;
+        source_size["h"] = frame_info.source_height;
 
         nlohmann::json sprite_source_size;
-        sprite_source_size["x"] = 0;
-        sprite_source_size["y"] = 0;
+        sprite_source_size["x"] = frame_info.offset_x;
+        sprite_source_size["y"] = frame_info.offset_y;
         sprite_source_size["w"] = rect.w;
         sprite_source_size["h"] = rect.h;
 
@@ -563,9 +4001,29 @@ void WriteGenericJson(const std::vector<stbrp_rect>& rects, const Context& conte
         object["source_size"] = source_size;
         object["sprite_source_size"] = sprite_source_size;
 
+        if(context.deduplicate_flips)
+        {
+            object["flip_x"] = frame_infos[rect.id].flip_x;
+            object["flip_y"] = frame_infos[rect.id].flip_y;
+        }
+
+        if(context.polygon_mesh_vertices > 0)
+            object["mesh"] = PolygonMeshToJson(frame_info, rect, context);
+
+        if(context.opaque_rects)
+            object["opaque_rect"] = OpaqueRectToJson(frame_info);
+
+        if(context.hit_mask_threshold > 0)
+            object["hit_mask"] = rect.id;
+
+        if(context.multi_page)
+            object["page"] = frame_info.page;
+
         frames.push_back(object);
     }
 
+    const std::vector<Context>& page_contexts = PageContexts(frame_infos, context);
+
     nlohmann::json output_size;
     output_size["w"] = context.output_width;
     output_size["h"] = context.output_height;
@@ -573,20 +4031,457 @@ void WriteGenericJson(const std::vector<stbrp_rect>& rects, const Context& conte
     nlohmann::json meta;
     meta["app"]     = "https://github.com/Niblitlvl50/SpriteBaker";
     meta["version"] = version;
-    meta["image"]   = context.output_file;
+    meta["image"]   = page_contexts.front().output_file;
     meta["format"]  = "RGBA8888";
     meta["size"]    = output_size;
     meta["scale"]   = "1";
 
+    if(context.hit_mask_threshold > 0)
+        meta["hit_masks"] = HitMaskFile(context);
+
+    if(context.premultiply_alpha)
+        meta["premultiplied_alpha"] = true;
+
+    if(context.mip_levels > 0)
+    {
+        meta["mip_chain"] = MipChainFile(page_contexts.front());
+        meta["mip_levels"] = context.mip_levels;
+    }
+
+    if(context.multi_page)
+    {
+        meta["pages"] = PageFiles(page_contexts, [](const Context& page_context) { return page_context.output_file; });
+        if(context.mip_levels > 0)
+            meta["mip_chains"] = PageFiles(page_contexts, MipChainFile);
+    }
+
     nlohmann::json json;
     json["frames"]  = frames;
     json["meta"]    = meta;
 
-    const size_t dot_pos = context.output_file.find_last_of(".");
-    const std::string& json_filename = context.output_file.substr(0, dot_pos) + ".json";
+    const std::string& json_filename = GenericJsonFile(context);
 
     std::ofstream out_file(json_filename);
     out_file << std::setw(4) << json << std::endl;
+
+    return json_filename;
+}
+
+// Hashes everything that ends up in the output files. The jobs and cache settings only affect how the
+// output is produced, not what it is, so they're left out and the entries can be shared between machines.
+uint64_t ArtifactCacheKey(const Context& context)
+{
+    nlohmann::json settings;
+    settings["version"] = version;
+    settings["input_files"] = context.input_files;
+    settings["output_file"] = context.output_file;
+    settings["output_width"] = context.output_width;
+    settings["output_height"] = context.output_height;
+    settings["scale_in_percentage"] = context.scale_in_percentage;
+    settings["padding"] = context.padding;
+    settings["background"] = { context.background_r, context.background_g, context.background_b, context.background_a };
+    settings["trim_images"] = context.trim_images;
+    settings["deduplicate"] = context.deduplicate;
+    settings["deduplicate_flips"] = context.deduplicate_flips;
+    settings["polygon_mesh_vertices"] = context.polygon_mesh_vertices;
+    settings["opaque_rects"] = context.opaque_rects;
+    settings["hit_mask_threshold"] = context.hit_mask_threshold;
+    settings["write_sprite_format"] = context.write_sprite_format;
+    settings["layout_only"] = context.layout_only;
+    settings["sprite_folder"] = context.sprite_folder;
+    settings["previous_layout"] = context.previous_layout;
+    settings["layout_slack"] = context.layout_slack;
+    settings["scales"] = context.scales;
+    settings["proportional_layout"] = context.proportional_layout;
+    settings["mip_levels"] = context.mip_levels;
+    settings["mip_coverage_reference"] = context.mip_coverage_reference;
+    settings["premultiply_alpha"] = context.premultiply_alpha;
+    settings["srgb"] = context.srgb;
+    settings["scale_filter"] = int(context.scale_filter);
+    settings["packer"] = int(context.packer);
+    settings["pack_heuristic"] = context.pack_heuristic;
+    settings["pack_order"] = int(context.pack_order);
+    settings["pack_search"] = context.pack_search;
+    settings["auto_size"] = context.auto_size;
+    settings["auto_size_pow2"] = context.auto_size_pow2;
+    settings["auto_size_square"] = context.auto_size_square;
+    settings["max_size"] = context.max_size;
+    settings["size_multiple"] = context.size_multiple;
+    settings["multi_page"] = context.multi_page;
+
+    const std::string& settings_string = settings.dump();
+    uint64_t key = HashBytes(settings_string.data(), settings_string.size());
+
+    std::vector<uint64_t> content_hashes(context.input_files.size());
+    const auto hash_file = [&](size_t index) {
+        const std::vector<unsigned char>& file_bytes = ReadFileBytes(context.input_files[index]);
+        content_hashes[index] = HashBytes(file_bytes.data(), file_bytes.size());
+    };
+    ParallelFor(context.input_files.size(), context.jobs, hash_file);
+
+    key = HashBytes(content_hashes.data(), content_hashes.size() * sizeof(uint64_t), key);
+
+    // An incremental bake starts from the previous layout and output image.
+    if(!context.previous_layout.empty())
+    {
+        for(const std::string& file : { context.previous_layout, context.output_file })
+        {
+            if(std::filesystem::is_regular_file(file))
+            {
+                const std::vector<unsigned char>& file_bytes = ReadFileBytes(file);
+                key = HashBytes(file_bytes.data(), file_bytes.size(), key);
+            }
+        }
+    }
+
+    // Existing sprite files are merged into the new ones, so they are inputs as well.
+    if(context.write_sprite_format)
+    {
+        const std::string& output_folder = SpriteOutputFolder(context);
+
+        std::vector<std::string> sprite_files;
+        for(const auto& file_metadata : GatherSpriteMetadata(context))
+            sprite_files.push_back(output_folder + file_metadata.first + ".sprite");
+        std::sort(sprite_files.begin(), sprite_files.end());
+
+        for(const std::string& sprite_file : sprite_files)
+        {
+            key = HashBytes(sprite_file.data(), sprite_file.size(), key);
+            if(std::filesystem::is_regular_file(sprite_file))
+            {
+                const std::vector<unsigned char>& file_bytes = ReadFileBytes(sprite_file);
+                key = HashBytes(file_bytes.data(), file_bytes.size(), key);
+            }
+        }
+    }
+
+    return key;
+}
+
+// Copies the file next to its destination first and renames it into place, so readers never see a partial file.
+void CopyFileAtomic(const std::filesystem::path& source, const std::filesystem::path& destination)
+{
+    const std::filesystem::path temp_file = destination.string() + ".tmp" + ToHexString(std::random_device()());
+
+    try
+    {
+        std::filesystem::copy_file(source, temp_file, std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::rename(temp_file, destination);
+    }
+    catch(...)
+    {
+        std::error_code error;
+        std::filesystem::remove(temp_file, error);
+        throw;
+    }
+}
+
+// An artifact cache entry is a directory named after the key, with the output files stored as '0', '1', ...
+// and a manifest with their destinations. Entries are assembled in a temporary directory and renamed into
+// place, which is atomic on local file systems and NFS alike, so concurrent bakes never see partial entries.
+// Files are copied rather than hard linked in both directions, since the output files are rewritten in
+// place by later bakes which would otherwise modify the shared entry.
+bool RestoreArtifacts(const std::string& cache_dir, uint64_t key, std::vector<std::string>& restored_files)
+{
+    const std::filesystem::path entry = std::filesystem::path(cache_dir) / ToHexString(key);
+
+    try
+    {
+        std::ifstream manifest_stream(entry / "manifest.json");
+        if(!manifest_stream.good())
+            return false;
+
+        const nlohmann::json& manifest = nlohmann::json::parse(manifest_stream);
+        const std::vector<std::string>& files = manifest.at("files").get<std::vector<std::string>>();
+
+        for(size_t index = 0; index < files.size(); ++index)
+            CopyFileAtomic(entry / std::to_string(index), files[index]);
+
+        restored_files = files;
+        return true;
+    }
+    catch(const std::exception& error)
+    {
+        std::printf("Unable to restore from artifact cache, %s\n", error.what());
+    }
+
+    return false;
+}
+
+void StoreArtifacts(const std::string& cache_dir, uint64_t key, const std::vector<std::string>& files)
+{
+    const std::filesystem::path entry = std::filesystem::path(cache_dir) / ToHexString(key);
+    const std::filesystem::path temp_entry = entry.string() + ".tmp" + ToHexString(std::random_device()());
+
+    std::error_code error;
+    if(std::filesystem::exists(entry, error))
+        return;
+
+    try
+    {
+        std::filesystem::create_directories(temp_entry);
+
+        for(size_t index = 0; index < files.size(); ++index)
+            std::filesystem::copy_file(files[index], temp_entry / std::to_string(index));
+
+        nlohmann::json manifest;
+        manifest["files"] = files;
+
+        std::ofstream manifest_stream(temp_entry / "manifest.json");
+        manifest_stream << std::setw(4) << manifest << std::endl;
+        manifest_stream.close();
+        if(!manifest_stream)
+            throw std::runtime_error("unable to write manifest");
+
+        // Fails if another bake stored the same entry in the meantime, which is fine.
+        std::filesystem::rename(temp_entry, entry, error);
+    }
+    catch(const std::exception& error)
+    {
+        std::printf("Unable to store in artifact cache, %s\n", error.what());
+    }
+
+    std::filesystem::remove_all(temp_entry, error);
+}
+
+// Meshes and opaque rects are found in the pixels of every frame.
+void AnalyzeFrames(const std::vector<ImageData>& images, std::vector<FrameInfo>& frames, const Context& context)
+{
+    if(context.polygon_mesh_vertices > 0)
+    {
+        const auto build_mesh = [&](size_t index) {
+            BuildPolygonMesh(images[index], context.polygon_mesh_vertices, frames[index]);
+        };
+        ParallelFor(images.size(), context.jobs, build_mesh);
+    }
+
+    if(context.opaque_rects)
+    {
+        const auto find_opaque_rect = [&](size_t index) {
+            frames[index].opaque_rect = FindOpaqueRect(images[index]);
+        };
+        ParallelFor(images.size(), context.jobs, find_opaque_rect);
+    }
+}
+
+// Writes everything but the output image, returns the written files.
+std::vector<std::string> WriteLayoutFiles(
+    const std::vector<ImageData>& images, const std::vector<stbrp_rect>& rects, const std::vector<FrameInfo>& frames, const Context& context)
+{
+    std::vector<std::string> written_files;
+
+    if(context.hit_mask_threshold > 0)
+        written_files.push_back(WriteHitMasks(images, frames, context));
+
+    if(context.write_sprite_format)
+    {
+        const std::vector<std::string>& sprite_files = WriteSpriteFiles(rects, frames, context);
+        written_files.insert(written_files.end(), sprite_files.begin(), sprite_files.end());
+    }
+    else
+    {
+        written_files.push_back(WriteGenericJson(rects, frames, context));
+    }
+
+    return written_files;
+}
+
+// 'atlas.png' at 200% is 'atlas@2x.png', at 50% 'atlas@0.5x.png' and at 100% just 'atlas.png'.
+std::string ScaledOutputFile(const std::string& output_file, int scale_percentage)
+{
+    if(scale_percentage == 100)
+        return output_file;
+
+    std::string scale_string = std::to_string(scale_percentage / 100);
+    if(scale_percentage % 100 != 0)
+    {
+        char fraction[4];
+        std::snprintf(fraction, sizeof(fraction), "%02d", scale_percentage % 100);
+        scale_string += "." + std::string(fraction);
+        scale_string.erase(scale_string.find_last_not_of('0') + 1);
+    }
+
+    const size_t dot_pos = output_file.find_last_of(".");
+    return output_file.substr(0, dot_pos) + "@" + scale_string + "x" + output_file.substr(dot_pos);
+}
+
+// The settings of a single scale of a multi scale bake, the output image size is given at 100%.
+Context ScaleContext(const Context& context, int scale_percentage)
+{
+    Context scale_context = context;
+    scale_context.scales.clear();
+    scale_context.scale_in_percentage = scale_percentage;
+    scale_context.output_file = ScaledOutputFile(context.output_file, scale_percentage);
+
+    if(context.proportional_layout)
+    {
+        // Whole layout units, see PackImagesProportional.
+        const int unit_percentage = LayoutUnitPercentage(context.scales);
+        const int unit_pixels = scale_percentage / unit_percentage;
+        scale_context.output_width = context.output_width * unit_percentage / 100 * unit_pixels;
+        scale_context.output_height = context.output_height * unit_percentage / 100 * unit_pixels;
+    }
+    else
+    {
+        scale_context.output_width = ScaledSize(context.output_width, scale_percentage);
+        scale_context.output_height = ScaledSize(context.output_height, scale_percentage);
+    }
+
+    return scale_context;
+}
+
+// Bakes an output image and json per scale, every input is only decoded once.
+std::vector<std::string> BakeScales(const Context& context)
+{
+    std::vector<Context> scale_contexts;
+    for(int scale : context.scales)
+        scale_contexts.push_back(ScaleContext(context, scale));
+
+    const std::vector<std::vector<ImageData>>& scale_images = LoadImageScales(scale_contexts);
+    const size_t scale_count = scale_contexts.size();
+
+    // A proportional layout has the same frames at every scale.
+    std::vector<std::vector<FrameInfo>> scale_frames(scale_count);
+    for(size_t scale_index = 0; scale_index < scale_count; ++scale_index)
+    {
+        if(context.proportional_layout && scale_index > 0)
+            scale_frames[scale_index] = scale_frames.front();
+        else if(context.deduplicate)
+            scale_frames[scale_index] = FindDuplicateImages(scale_images[scale_index], context.deduplicate_flips, context.jobs);
+        else
+            scale_frames[scale_index] = UniqueFrames(context.input_files.size());
+
+        if(context.proportional_layout && scale_index == 0 && context.deduplicate)
+            KeepCommonAliases(scale_frames.front(), scale_images);
+    }
+
+    std::vector<std::vector<stbrp_rect>> scale_rects(scale_count);
+    if(context.proportional_layout)
+    {
+        scale_rects = PackImagesProportional(scale_images, scale_frames.front(), context);
+    }
+    else
+    {
+        for(size_t scale_index = 0; scale_index < scale_count; ++scale_index)
+        {
+            Context& scale_context = scale_contexts[scale_index];
+            const std::vector<ImageSize>& sizes = ImageSizes(scale_images[scale_index]);
+            if(context.auto_size)
+                scale_rects[scale_index] = PackAutoSized(sizes, scale_frames[scale_index], scale_context);
+            else
+                scale_rects[scale_index] = PackLayout(sizes, scale_frames[scale_index], scale_context);
+        }
+    }
+
+    std::vector<std::string> written_files;
+
+    for(size_t scale_index = 0; scale_index < scale_count; ++scale_index)
+    {
+        const Context& scale_context = scale_contexts[scale_index];
+        const std::vector<ImageData>& images = scale_images[scale_index];
+        const std::vector<stbrp_rect>& rects = scale_rects[scale_index];
+        std::vector<FrameInfo>& frames = scale_frames[scale_index];
+
+        SetFrameSources(frames, images);
+        AnalyzeFrames(images, frames, scale_context);
+
+        if(!context.layout_only)
+        {
+            WriteImage(images, rects, frames, scale_context);
+            written_files.push_back(scale_context.output_file);
+            if(context.mip_levels > 0)
+                written_files.push_back(MipChainFile(scale_context));
+        }
+
+        const std::vector<std::string>& layout_files = WriteLayoutFiles(images, rects, frames, scale_context);
+        written_files.insert(written_files.end(), layout_files.begin(), layout_files.end());
+    }
+
+    return written_files;
+}
+
+// Returns all the files that were written. The context is a copy, -auto_size picks the output image size in it.
+std::vector<std::string> Bake(Context context)
+{
+    if(!context.scales.empty())
+        return BakeScales(context);
+
+    std::vector<std::string> written_files;
+    std::vector<stbrp_rect> rects;
+    std::vector<ImageData> images;
+    std::vector<ImageSize> sizes;
+    std::vector<FrameInfo> frames;
+
+    // Trimmed sizes and duplicates are only known after decoding, meshes, opaque rects and hit masks are found in the pixels.
+    const bool decode_before_packing = context.trim_images || context.deduplicate || context.polygon_mesh_vertices > 0 ||
+        context.opaque_rects || context.hit_mask_threshold > 0;
+    if(decode_before_packing)
+    {
+        images = LoadImages(context);
+        sizes = ImageSizes(images);
+    }
+    else
+    {
+        // Pack from the image headers first, so a too small output image fails before any pixels are decoded.
+        sizes = ProbeImages(context.input_files, context.scale_in_percentage, context.jobs);
+    }
+
+    if(context.deduplicate)
+        frames = FindDuplicateImages(images, context.deduplicate_flips, context.jobs);
+    else
+        frames = UniqueFrames(sizes.size());
+
+    if(decode_before_packing)
+        SetFrameSources(frames, images);
+    else
+        SetFrameSources(frames, sizes);
+
+    AnalyzeFrames(images, frames, context);
+
+    PreviousLayout previous;
+    if(!context.previous_layout.empty())
+        previous = ReadPreviousLayout(context.previous_layout);
+
+    if(context.multi_page)
+        rects = PackPages(sizes, frames, context);
+    else if(context.auto_size)
+        rects = PackAutoSized(sizes, frames, context);
+    else if(previous.rects.empty())
+        rects = PackLayout(sizes, frames, context);
+    else
+        rects = PackImagesIncremental(sizes, frames, previous, context);
+
+    if(!context.layout_only)
+    {
+        bool patched = false;
+        if(!previous.rects.empty())
+            patched = PatchOutputImage(decode_before_packing ? &images : nullptr, rects, frames, previous, context);
+
+        if(!patched)
+        {
+            if(context.multi_page)
+                WritePages(decode_before_packing ? &images : nullptr, rects, frames, context);
+            else if(decode_before_packing)
+                WriteImage(images, rects, frames, context);
+            else
+                BakeImages(rects, context);
+        }
+    }
+
+    if(!context.layout_only)
+    {
+        for(const Context& page_context : PageContexts(frames, context))
+        {
+            written_files.push_back(page_context.output_file);
+            if(context.mip_levels > 0)
+                written_files.push_back(MipChainFile(page_context));
+        }
+    }
+
+    const std::vector<std::string>& layout_files = WriteLayoutFiles(images, rects, frames, context);
+    written_files.insert(written_files.end(), layout_files.begin(), layout_files.end());
+
+    return written_files;
 }
 
 int main(int argv, const char* argc[])
@@ -594,20 +4489,29 @@ int main(int argv, const char* argc[])
     const auto& start_time = std::chrono::system_clock::now();
     
     Context context;
+    bool restored_from_cache = false;
+    std::vector<std::string> baked_files;
 
     try
     {
         ParseArguments(argv, argc, context);
         std::printf("Found '%lu' input files.\n", context.input_files.size());
 
-        const std::vector<ImageData>& images = LoadImages(context.input_files, context.trim_images, context.scale_in_percentage);
-        const std::vector<stbrp_rect>& rects = PackImages(images, context.output_width, context.output_height, context.padding);
-        WriteImage(images, rects, context);
-        
-        if(context.write_sprite_format)
-            WriteSpriteFiles(rects, context);
+        if(context.artifact_cache.empty())
+        {
+            baked_files = Bake(context);
+        }
         else
-            WriteGenericJson(rects, context);
+        {
+            const uint64_t key = ArtifactCacheKey(context);
+
+            restored_from_cache = RestoreArtifacts(context.artifact_cache, key, baked_files);
+            if(!restored_from_cache)
+            {
+                baked_files = Bake(context);
+                StoreArtifacts(context.artifact_cache, key, baked_files);
+            }
+        }
     }
     catch(const std::runtime_error& error)
     {
@@ -615,10 +4519,10 @@ int main(int argv, const char* argc[])
         std::printf("\n");
         std::printf("Usage: spritebaker -width 512 -height 512 -input [image1.png image1.png ...] -output sprite_atlas.png\n");
         std::printf("Required arguments:\n");
-        std::printf("\t-width, -height, -input, -output\n");
+        std::printf("\t-width, -height (or -auto_size), -input, -output\n");
         std::printf("\n");
         std::printf("Optional arguments:\n");
-        std::printf("\t-bg_color [r g b a, 0 - 255], -padding [>= 0], -scale [percentage] -trim_images [flag], -sprite_format [flag]\n");
+        std::printf("\t-bg_color [r g b a, 0 - 255], -padding [>= 0], -scale [percentage] -trim_images [flag], -sprite_format [flag], -dedup [flag], -dedup_flips [flag], -polygon_mesh [max vertices], -opaque_rects [flag], -hit_masks [threshold], -jobs [>= 1], -layout_only [flag], -cache_dir [path], -artifact_cache [path], -previous_layout [json file], -layout_slack [>= 0], -scales [percentages], -proportional_layout [flag], -mip_levels [1 - 15], -mip_coverage [alpha reference], -premultiply_alpha [flag], -srgb [flag], -scale_filter [nearest|box|default], -packer [skyline|maxrects], -pack_heuristic [bl|bf or bssf|baf|bl|cp], -pack_order [default|height|width|area|max_side|perimeter], -pack_search [flag], -auto_size [pow2 square], -max_size [pixels], -size_multiple [>= 1], -multi_page [flag]\n");
         std::printf("\nVersion: %s\n", version);
         std::printf("\n");
 
@@ -628,11 +4532,34 @@ int main(int argv, const char* argc[])
     const auto& time_diff = std::chrono::system_clock::now() - start_time;
     const auto& ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_diff);
 
+    if(restored_from_cache)
+        std::printf("Restored from artifact cache '%s'\n", context.artifact_cache.c_str());
+
     std::printf("Successfully baked [version: %s]\n", version);
     for(const std::string& file : context.input_files)
         std::printf("\t'%s'\n", file.c_str());
     
-    std::printf("to '%s' during %ld ms\n", context.output_file.c_str(), ms.count());
+    std::vector<std::string> output_files;
+    for(int scale : context.scales)
+        output_files.push_back(ScaledOutputFile(context.output_file, scale));
+    for(int page = 0; context.multi_page; ++page)
+    {
+        const std::string& page_file = PageOutputFile(context.output_file, page);
+        if(std::find(baked_files.begin(), baked_files.end(), page_file) == baked_files.end())
+            break;
+        output_files.push_back(page_file);
+    }
+    if(output_files.empty())
+        output_files.push_back(context.output_file);
+
+    std::string output_files_string;
+    for(const std::string& file : output_files)
+        output_files_string += (output_files_string.empty() ? "'" : ", '") + file + "'";
+
+    if(context.layout_only)
+        std::printf("to the layout of %s during %ld ms\n", output_files_string.c_str(), ms.count());
+    else
+        std::printf("to %s during %ld ms\n", output_files_string.c_str(), ms.count());
 
     return 0;
 }
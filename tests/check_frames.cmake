@@ -0,0 +1,445 @@
+# Runs a bake and checks the output files and the frames in the output json.
+#
+# SPRITEBAKER       path to the spritebaker executable
+# CLEAN             optional ';' separated list of files and directories removed before baking, like caches
+# FIRST_BAKE_ARGS   optional ';' separated command line of a bake that runs first, to fill a cache or write a previous layout
+# BAKE_ARGS         ';' separated command line, must contain -output
+# OUTPUT_REGEX      optional regex the output of the bake must match
+# JSON              ';' separated list of the json files the bake writes, the size and frames are checked in the first one
+# FILES             optional ';' separated list of the other files the bake writes, each must be named in one of the json files
+# IDENTICAL         optional ';' separated list of files that must be byte for byte identical
+# SIZE              optional output image size as width:height
+# FRAMES            optional ';' separated list of filename:frame_w:frame_h:source_w:source_h[:frame_x:frame_y]
+# FLIPS             optional ';' separated list of filename:flip_x:flip_y, with true or false flags
+# OFFSETS           optional ';' separated list of filename:x:y of the trimmed frame within its source
+# OPAQUE_RECTS      optional ';' separated list of filename:x:y:w:h
+# MESHES            optional ';' separated list of filename:max_vertices, the uvs must map the vertices into the frame
+# MESH_POINTS       optional ';' separated list of filename:x:y, source pixel corners that must be inside the mesh
+# MIP_BLOCK         optional block size the cells of the FRAMES are aligned to, with PADDING around every frame
+# BYTES_FILE        optional file BYTES are checked in
+# BYTES             optional ';' separated list of offset:hex bytes
+# KTX               optional ktx file with KTX_LEVELS mip levels, and an optional KTX_FORMAT glInternalFormat in hex
+
+if(CLEAN)
+    file(REMOVE_RECURSE ${CLEAN})
+endif()
+file(REMOVE ${JSON} ${FILES} ${IDENTICAL} ${BYTES_FILE} ${KTX})
+
+if(FIRST_BAKE_ARGS)
+    execute_process(COMMAND ${SPRITEBAKER} ${FIRST_BAKE_ARGS} RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "first spritebaker run failed: ${result}")
+    endif()
+endif()
+
+execute_process(COMMAND ${SPRITEBAKER} ${BAKE_ARGS} RESULT_VARIABLE result OUTPUT_VARIABLE output)
+message("${output}")
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "spritebaker failed: ${result}")
+endif()
+if(OUTPUT_REGEX AND NOT output MATCHES "${OUTPUT_REGEX}")
+    message(FATAL_ERROR "spritebaker output doesn't match '${OUTPUT_REGEX}'")
+endif()
+
+set(all_json "")
+foreach(json_file ${JSON})
+    if(NOT EXISTS ${json_file})
+        message(FATAL_ERROR "'${json_file}' wasn't written")
+    endif()
+    file(READ ${json_file} json_content)
+    string(APPEND all_json "${json_content}")
+endforeach()
+
+foreach(output_file ${FILES})
+    if(NOT EXISTS ${output_file})
+        message(FATAL_ERROR "'${output_file}' wasn't written")
+    endif()
+    string(FIND "${all_json}" "\"${output_file}\"" position)
+    if(position EQUAL -1)
+        message(FATAL_ERROR "'${output_file}' isn't named in ${JSON}")
+    endif()
+endforeach()
+
+if(IDENTICAL)
+    list(GET IDENTICAL 0 first_file)
+    foreach(other_file ${IDENTICAL})
+        execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${first_file} ${other_file} RESULT_VARIABLE result)
+        if(NOT result EQUAL 0)
+            message(FATAL_ERROR "'${other_file}' differs from '${first_file}'")
+        endif()
+    endforeach()
+endif()
+
+list(GET JSON 0 first_json)
+file(READ ${first_json} json)
+
+set(ws "[ \t\r\n]*")
+set(number "-?[0-9][-+0-9.eE]*")
+
+string(REGEX MATCH "\"size\":${ws}{${ws}\"h\":${ws}([0-9]+),${ws}\"w\":${ws}([0-9]+)" unused "${json}")
+set(output_height ${CMAKE_MATCH_1})
+set(output_width ${CMAKE_MATCH_2})
+
+if(SIZE)
+    string(REPLACE ":" ";" fields ${SIZE})
+    list(GET fields 0 width)
+    list(GET fields 1 height)
+
+    if(NOT output_height STREQUAL height OR NOT output_width STREQUAL width)
+        message(FATAL_ERROR "output image is ${output_width}x${output_height}, expected ${width}x${height}")
+    endif()
+endif()
+
+# The json text of the frame of 'filename', from its name to its last field.
+function(find_frame_entry filename)
+    string(REPLACE "." "\\." filename_regex ${filename})
+    string(REGEX MATCH "\"filename\":${ws}\"${filename_regex}\"" name_field "${json}")
+    if(NOT name_field)
+        message(FATAL_ERROR "'${filename}' missing from ${first_json}")
+    endif()
+
+    string(FIND "${json}" "${name_field}" begin)
+    string(SUBSTRING "${json}" ${begin} -1 rest)
+    string(REGEX MATCH "\"trimmed\":${ws}[a-z]+" last_field "${rest}")
+    string(FIND "${rest}" "${last_field}" end)
+    string(LENGTH "${last_field}" last_field_length)
+    math(EXPR end "${end} + ${last_field_length}")
+    string(SUBSTRING "${rest}" 0 ${end} entry)
+    set(entry "${entry}" PARENT_SCOPE)
+endfunction()
+
+# The x, y, w and h of the '"name": { ... }' rect in the entry.
+function(find_rect entry name)
+    string(REGEX MATCH "\"${name}\":${ws}{${ws}\"h\":${ws}([0-9]+),${ws}\"w\":${ws}([0-9]+),${ws}\"x\":${ws}([0-9]+),${ws}\"y\":${ws}([0-9]+)" unused "${entry}")
+    if(NOT CMAKE_MATCH_0)
+        message(FATAL_ERROR "'${name}' missing from '${entry}'")
+    endif()
+    set(rect_x ${CMAKE_MATCH_3} PARENT_SCOPE)
+    set(rect_y ${CMAKE_MATCH_4} PARENT_SCOPE)
+    set(rect_w ${CMAKE_MATCH_2} PARENT_SCOPE)
+    set(rect_h ${CMAKE_MATCH_1} PARENT_SCOPE)
+endfunction()
+
+# A json number as an integer in units of 10^-digits, the digits past that are dropped.
+function(to_fixed value digits output)
+    string(REGEX MATCH "^(-?)([0-9]+)(\\.([0-9]*))?([eE]([-+]?[0-9]+))?$" unused "${value}")
+    if(NOT CMAKE_MATCH_0)
+        message(FATAL_ERROR "'${value}' isn't a number")
+    endif()
+
+    set(sign "${CMAKE_MATCH_1}")
+    set(mantissa "${CMAKE_MATCH_2}${CMAKE_MATCH_4}")
+    string(LENGTH "${CMAKE_MATCH_4}" fraction_length)
+    set(exponent 0)
+    if(CMAKE_MATCH_6)
+        string(REGEX REPLACE "^\\+" "" exponent "${CMAKE_MATCH_6}")
+    endif()
+
+    math(EXPR shift "${exponent} - ${fraction_length} + ${digits}")
+    if(shift GREATER_EQUAL 0)
+        foreach(unused RANGE 1 ${shift})
+            if(shift GREATER 0)
+                string(APPEND mantissa "0")
+            endif()
+        endforeach()
+    else()
+        string(LENGTH "${mantissa}" mantissa_length)
+        math(EXPR mantissa_length "${mantissa_length} + ${shift}")
+        if(mantissa_length GREATER 0)
+            string(SUBSTRING "${mantissa}" 0 ${mantissa_length} mantissa)
+        else()
+            set(mantissa 0)
+        endif()
+    endif()
+
+    # Leading zeros are dropped one at a time, a regex replace would match again after the first.
+    while(mantissa MATCHES "^0[0-9]")
+        string(SUBSTRING "${mantissa}" 1 -1 mantissa)
+    endwhile()
+    set(${output} "${sign}${mantissa}" PARENT_SCOPE)
+endfunction()
+
+# The numbers of the '"name": [ ... ]' array in the entry, nested arrays are flattened.
+function(find_numbers entry name)
+    string(REGEX MATCH "\"${name}\":${ws}\\[[-+0-9.eE, \t\r\n]*(\\[[-+0-9.eE, \t\r\n]*\\][, \t\r\n]*)*\\]" array "${entry}")
+    if(NOT array)
+        message(FATAL_ERROR "'${name}' missing from '${entry}'")
+    endif()
+    string(REGEX REPLACE "^\"${name}\":" "" array "${array}")
+    string(REGEX MATCHALL "${number}" numbers "${array}")
+    set(numbers "${numbers}" PARENT_SCOPE)
+endfunction()
+
+# The little endian 32 bit unsigned integer at 'offset' in 'file', empty past the end of the file.
+function(read_uint32 file offset output)
+    file(READ ${file} bytes OFFSET ${offset} LIMIT 4 HEX)
+    set(value "")
+    string(LENGTH "${bytes}" length)
+    if(length EQUAL 8)
+        set(value 0)
+        foreach(byte_index 3 2 1 0)
+            math(EXPR position "${byte_index} * 2")
+            string(SUBSTRING "${bytes}" ${position} 2 byte)
+            foreach(digit_index 0 1)
+                string(SUBSTRING "${byte}" ${digit_index} 1 digit)
+                string(FIND "0123456789abcdef" "${digit}" digit_value)
+                math(EXPR value "${value} * 16 + ${digit_value}")
+            endforeach()
+        endforeach()
+    endif()
+    set(${output} "${value}" PARENT_SCOPE)
+endfunction()
+
+set(mip_cells "")
+foreach(frame ${FRAMES})
+    string(REPLACE ":" ";" fields ${frame})
+    list(GET fields 0 filename)
+    list(GET fields 1 frame_w)
+    list(GET fields 2 frame_h)
+    list(GET fields 3 source_w)
+    list(GET fields 4 source_h)
+
+    find_frame_entry(${filename})
+
+    find_rect("${entry}" frame)
+    if(NOT rect_h STREQUAL frame_h OR NOT rect_w STREQUAL frame_w)
+        message(FATAL_ERROR "'${filename}' frame is ${rect_w}x${rect_h}, expected ${frame_w}x${frame_h}")
+    endif()
+
+    list(LENGTH fields field_count)
+    if(field_count EQUAL 7)
+        list(GET fields 5 frame_x)
+        list(GET fields 6 frame_y)
+        if(NOT rect_x STREQUAL frame_x OR NOT rect_y STREQUAL frame_y)
+            message(FATAL_ERROR "'${filename}' frame is at ${rect_x},${rect_y}, expected ${frame_x},${frame_y}")
+        endif()
+    endif()
+
+    if(MIP_BLOCK)
+        if(NOT PADDING)
+            set(PADDING 0)
+        endif()
+        math(EXPR cell_x "${rect_x} - ${PADDING}")
+        math(EXPR cell_y "${rect_y} - ${PADDING}")
+        math(EXPR cell_w "(${rect_w} + ${PADDING} * 2 + ${MIP_BLOCK} - 1) / ${MIP_BLOCK} * ${MIP_BLOCK}")
+        math(EXPR cell_h "(${rect_h} + ${PADDING} * 2 + ${MIP_BLOCK} - 1) / ${MIP_BLOCK} * ${MIP_BLOCK}")
+        math(EXPR misalignment "${cell_x} % ${MIP_BLOCK} + ${cell_y} % ${MIP_BLOCK}")
+        if(NOT misalignment EQUAL 0 OR cell_x LESS 0 OR cell_y LESS 0)
+            message(FATAL_ERROR "'${filename}' cell at ${cell_x},${cell_y} isn't aligned to ${MIP_BLOCK} pixel blocks")
+        endif()
+
+        foreach(other_cell ${mip_cells})
+            string(REPLACE "," ";" other_fields "${other_cell}")
+            list(GET other_fields 0 other_x)
+            list(GET other_fields 1 other_y)
+            list(GET other_fields 2 other_w)
+            list(GET other_fields 3 other_h)
+            if("${other_cell}" STREQUAL "${cell_x},${cell_y},${cell_w},${cell_h}")
+                continue()
+            endif()
+            math(EXPR cell_right "${cell_x} + ${cell_w}")
+            math(EXPR cell_bottom "${cell_y} + ${cell_h}")
+            math(EXPR other_right "${other_x} + ${other_w}")
+            math(EXPR other_bottom "${other_y} + ${other_h}")
+            if(cell_x LESS other_right AND other_x LESS cell_right AND cell_y LESS other_bottom AND other_y LESS cell_bottom)
+                message(FATAL_ERROR "'${filename}' cell ${cell_x},${cell_y} ${cell_w}x${cell_h} overlaps another cell")
+            endif()
+        endforeach()
+        list(APPEND mip_cells "${cell_x},${cell_y},${cell_w},${cell_h}")
+    endif()
+
+    string(REGEX MATCH "\"source_size\":${ws}{${ws}\"h\":${ws}([0-9]+),${ws}\"w\":${ws}([0-9]+)" unused "${entry}")
+    if(NOT CMAKE_MATCH_1 STREQUAL source_h OR NOT CMAKE_MATCH_2 STREQUAL source_w)
+        message(FATAL_ERROR "'${filename}' source size is ${CMAKE_MATCH_2}x${CMAKE_MATCH_1}, expected ${source_w}x${source_h}")
+    endif()
+endforeach()
+
+foreach(flip ${FLIPS})
+    string(REPLACE ":" ";" fields ${flip})
+    list(GET fields 0 filename)
+    list(GET fields 1 flip_x)
+    list(GET fields 2 flip_y)
+
+    find_frame_entry(${filename})
+
+    string(REGEX MATCH "\"flip_x\":${ws}([a-z]+),${ws}\"flip_y\":${ws}([a-z]+)" unused "${entry}")
+    if(NOT CMAKE_MATCH_1 STREQUAL flip_x OR NOT CMAKE_MATCH_2 STREQUAL flip_y)
+        message(FATAL_ERROR "'${filename}' flips are ${CMAKE_MATCH_1},${CMAKE_MATCH_2}, expected ${flip_x},${flip_y}")
+    endif()
+endforeach()
+
+foreach(offset ${OFFSETS})
+    string(REPLACE ":" ";" fields ${offset})
+    list(GET fields 0 filename)
+    list(GET fields 1 offset_x)
+    list(GET fields 2 offset_y)
+
+    find_frame_entry(${filename})
+    find_rect("${entry}" sprite_source_size)
+    if(NOT rect_x STREQUAL offset_x OR NOT rect_y STREQUAL offset_y)
+        message(FATAL_ERROR "'${filename}' is trimmed at ${rect_x},${rect_y}, expected ${offset_x},${offset_y}")
+    endif()
+endforeach()
+
+foreach(opaque_rect ${OPAQUE_RECTS})
+    string(REPLACE ":" ";" fields ${opaque_rect})
+    list(GET fields 0 filename)
+    list(GET fields 1 opaque_x)
+    list(GET fields 2 opaque_y)
+    list(GET fields 3 opaque_w)
+    list(GET fields 4 opaque_h)
+
+    find_frame_entry(${filename})
+    find_rect("${entry}" opaque_rect)
+    if(NOT "${rect_x}:${rect_y}:${rect_w}:${rect_h}" STREQUAL "${opaque_x}:${opaque_y}:${opaque_w}:${opaque_h}")
+        message(FATAL_ERROR "'${filename}' opaque rect is ${rect_x},${rect_y} ${rect_w}x${rect_h}, expected ${opaque_x},${opaque_y} ${opaque_w}x${opaque_h}")
+    endif()
+endforeach()
+
+# Mesh coordinates are compared in thousandths of a pixel.
+foreach(mesh ${MESHES})
+    string(REPLACE ":" ";" fields ${mesh})
+    list(GET fields 0 filename)
+    list(GET fields 1 max_vertices)
+
+    find_frame_entry(${filename})
+    find_rect("${entry}" frame)
+    set(frame_x ${rect_x})
+    set(frame_y ${rect_y})
+    find_rect("${entry}" sprite_source_size)
+
+    find_numbers("${entry}" vertices)
+    set(vertices ${numbers})
+    find_numbers("${entry}" uvs)
+    set(uvs ${numbers})
+    find_numbers("${entry}" indices)
+    set(indices ${numbers})
+
+    list(LENGTH vertices vertex_count)
+    math(EXPR vertex_count "${vertex_count} / 2")
+    if(vertex_count LESS 3 OR vertex_count GREATER max_vertices)
+        message(FATAL_ERROR "'${filename}' mesh has ${vertex_count} vertices, expected 3 - ${max_vertices}")
+    endif()
+
+    list(LENGTH indices index_count)
+    math(EXPR expected_index_count "(${vertex_count} - 2) * 3")
+    if(NOT index_count EQUAL expected_index_count)
+        message(FATAL_ERROR "'${filename}' mesh has ${index_count} indices, expected ${expected_index_count}")
+    endif()
+
+    # The uv of every vertex is its pixel in the output image, relative to the trimmed frame.
+    math(EXPR last_vertex "${vertex_count} - 1")
+    set(mesh_x "")
+    set(mesh_y "")
+    foreach(vertex RANGE ${last_vertex})
+        math(EXPR x_index "${vertex} * 2")
+        math(EXPR y_index "${vertex} * 2 + 1")
+        list(GET vertices ${x_index} vertex_x)
+        list(GET vertices ${y_index} vertex_y)
+        list(GET uvs ${x_index} u)
+        list(GET uvs ${y_index} v)
+        to_fixed(${vertex_x} 3 vertex_x)
+        to_fixed(${vertex_y} 3 vertex_y)
+        to_fixed(${u} 6 u)
+        to_fixed(${v} 6 v)
+        list(APPEND mesh_x ${vertex_x})
+        list(APPEND mesh_y ${vertex_y})
+
+        math(EXPR u_error "${u} * ${output_width} / 1000 - (${frame_x} - ${rect_x}) * 1000 - ${vertex_x}")
+        math(EXPR v_error "${v} * ${output_height} / 1000 - (${frame_y} - ${rect_y}) * 1000 - ${vertex_y}")
+        if(u_error GREATER 10 OR u_error LESS -10 OR v_error GREATER 10 OR v_error LESS -10)
+            message(FATAL_ERROR "'${filename}' mesh uv ${u},${v} doesn't map vertex ${vertex_x},${vertex_y} into the frame")
+        endif()
+    endforeach()
+
+    # Every point is on the same side of all the edges of the convex mesh, or on an edge.
+    foreach(point ${MESH_POINTS})
+        string(REPLACE ":" ";" point_fields ${point})
+        list(GET point_fields 0 point_filename)
+        if(NOT point_filename STREQUAL filename)
+            continue()
+        endif()
+        list(GET point_fields 1 point_x)
+        list(GET point_fields 2 point_y)
+        math(EXPR point_x "${point_x} * 1000")
+        math(EXPR point_y "${point_y} * 1000")
+
+        set(has_left OFF)
+        set(has_right OFF)
+        foreach(vertex RANGE ${last_vertex})
+            math(EXPR next_vertex "(${vertex} + 1) % ${vertex_count}")
+            list(GET mesh_x ${vertex} x0)
+            list(GET mesh_y ${vertex} y0)
+            list(GET mesh_x ${next_vertex} x1)
+            list(GET mesh_y ${next_vertex} y1)
+            math(EXPR cross "(${x1} - ${x0}) * (${point_y} - ${y0}) - (${y1} - ${y0}) * (${point_x} - ${x0})")
+            if(cross GREATER 0)
+                set(has_left ON)
+            elseif(cross LESS 0)
+                set(has_right ON)
+            endif()
+        endforeach()
+        if(has_left AND has_right)
+            message(FATAL_ERROR "'${filename}' mesh doesn't contain ${point_x},${point_y} (thousandths of a pixel)")
+        endif()
+    endforeach()
+endforeach()
+
+foreach(bytes ${BYTES})
+    string(REPLACE ":" ";" fields ${bytes})
+    list(GET fields 0 offset)
+    list(GET fields 1 expected)
+    string(TOLOWER "${expected}" expected)
+    string(LENGTH "${expected}" length)
+    math(EXPR length "${length} / 2")
+
+    file(READ ${BYTES_FILE} actual OFFSET ${offset} LIMIT ${length} HEX)
+    if(NOT actual STREQUAL expected)
+        message(FATAL_ERROR "'${BYTES_FILE}' has ${actual} at ${offset}, expected ${expected}")
+    endif()
+endforeach()
+
+if(KTX)
+    file(READ ${KTX} identifier LIMIT 12 HEX)
+    if(NOT identifier STREQUAL "ab4b5458203131bb0d0a1a0a")
+        message(FATAL_ERROR "'${KTX}' has no KTX 1.1 identifier")
+    endif()
+
+    read_uint32(${KTX} 36 pixel_width)
+    read_uint32(${KTX} 40 pixel_height)
+    read_uint32(${KTX} 56 level_count)
+    read_uint32(${KTX} 60 key_value_bytes)
+
+    string(TOLOWER "${KTX_FORMAT}" expected_format)
+    file(READ ${KTX} format_bytes OFFSET 28 LIMIT 4 HEX)
+    string(REGEX REPLACE "^(..)(..)(..)(..)$" "\\4\\3\\2\\1" format_hex "${format_bytes}")
+    string(REGEX REPLACE "^0+" "" format_hex "${format_hex}")
+    if(KTX_FORMAT AND NOT format_hex STREQUAL expected_format)
+        message(FATAL_ERROR "'${KTX}' glInternalFormat is 0x${format_hex}, expected 0x${expected_format}")
+    endif()
+    if(NOT level_count EQUAL KTX_LEVELS)
+        message(FATAL_ERROR "'${KTX}' has ${level_count} mip levels, expected ${KTX_LEVELS}")
+    endif()
+    if(NOT "${pixel_width}x${pixel_height}" STREQUAL "${output_width}x${output_height}")
+        message(FATAL_ERROR "'${KTX}' is ${pixel_width}x${pixel_height}, expected ${output_width}x${output_height}")
+    endif()
+
+    # Every level halves the one before, and the file ends after the last.
+    math(EXPR level_offset "64 + ${key_value_bytes}")
+    math(EXPR last_level "${level_count} - 1")
+    foreach(level RANGE ${last_level})
+        math(EXPR level_width "${pixel_width} >> ${level}")
+        math(EXPR level_height "${pixel_height} >> ${level}")
+        math(EXPR expected_size "${level_width} * ${level_height} * 4")
+        read_uint32(${KTX} ${level_offset} level_size)
+        if(NOT level_size STREQUAL expected_size)
+            message(FATAL_ERROR "'${KTX}' level ${level} is ${level_size} bytes, expected ${expected_size}")
+        endif()
+        math(EXPR level_offset "${level_offset} + 4 + ${level_size}")
+    endforeach()
+
+    file(READ ${KTX} trailing OFFSET ${level_offset} LIMIT 1 HEX)
+    if(trailing)
+        message(FATAL_ERROR "'${KTX}' has data after the last level")
+    endif()
+endif()